@@ -0,0 +1,497 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "fs.h"
+#include "disk.h"
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void report( const char *what, int ops, double start, const struct disk_stats *before )
+{
+	struct disk_stats after;
+	double elapsed = now()-start;
+
+	disk_get_stats(&after);
+	printf("%-8s %8d ops %10.3f s %12.0f ops/s %8.2f reads/op %8.2f writes/op\n",
+		what,ops,elapsed,elapsed>0 ? ops/elapsed : 0,
+		ops ? (double)(after.reads-before->reads)/ops : 0,
+		ops ? (double)(after.writes-before->writes)/ops : 0);
+}
+
+static void report_rate( const char *what, int64_t bytes, double start )
+{
+	double elapsed = now()-start;
+	printf("%-8s %8.1f MB %10.3f s %12.1f MB/s\n",what,bytes/1048576.0,elapsed,elapsed>0 ? bytes/1048576.0/elapsed : 0);
+}
+
+/*
+Fill the inode table with n empty files, then churn it:
+delete a random file and create a new one, n times.
+All files are deleted again at the end.
+*/
+
+static int bench_create( int n )
+{
+	struct disk_stats before;
+	double start;
+	int i, k;
+	int *inodes = malloc(n*sizeof(int));
+
+	if(!inodes) return 0;
+
+	disk_get_stats(&before);
+	start = now();
+	for(i=0;i<n;i++) {
+		inodes[i] = fs_create();
+		if(!inodes[i]) break;
+	}
+	report("fill",i,start,&before);
+
+	if(i<n) {
+		printf("inode table full after %d files\n",i);
+		n = i;
+	}
+
+	srand(1);
+	disk_get_stats(&before);
+	start = now();
+	for(i=0;i<n;i++) {
+		k = rand()%n;
+		if(inodes[k]) fs_delete(inodes[k]);
+		inodes[k] = fs_create();
+		if(!inodes[k]) {
+			printf("create failed during churn\n");
+			break;
+		}
+	}
+	report("churn",i,start,&before);
+
+	for(i=0;i<n;i++) {
+		if(inodes[i]) fs_delete(inodes[i]);
+	}
+
+	free(inodes);
+	return 1;
+}
+
+/*
+Write a new file of n MB sequentially in 1 MB requests, then read it
+back the same way. Run it on each disk backend to compare throughput.
+*/
+
+#define SEQIO_CHUNK (1024*1024)
+
+static int bench_seqio( int n )
+{
+	struct disk_stats before;
+	double start;
+	int64_t offset;
+	int i, fd, inumber, result=1;
+	char *buffer = malloc(SEQIO_CHUNK);
+
+	if(!buffer) return 0;
+
+	inumber = fs_create();
+	fd = inumber>0 ? fs_open(inumber) : -1;
+	if(fd<0) {
+		free(buffer);
+		return 0;
+	}
+
+	for(i=0;i<SEQIO_CHUNK;i++) buffer[i] = i;
+
+	disk_get_stats(&before);
+	start = now();
+	for(i=0,offset=0;i<n;i++,offset+=SEQIO_CHUNK) {
+		if(fs_pwrite(fd,buffer,SEQIO_CHUNK,offset)!=SEQIO_CHUNK) {
+			printf("disk full after %d MB\n",i);
+			result = 0;
+			break;
+		}
+	}
+	fs_sync();
+	disk_flush();
+	report("write",i,start,&before);
+	report_rate("write",offset,start);
+	n = i;
+
+	disk_get_stats(&before);
+	start = now();
+	for(i=0,offset=0;i<n;i++,offset+=SEQIO_CHUNK) {
+		if(fs_pread(fd,buffer,SEQIO_CHUNK,offset)!=SEQIO_CHUNK) {
+			result = 0;
+			break;
+		}
+	}
+	report("read",i,start,&before);
+	report_rate("read",offset,start);
+
+	fs_close(fd);
+	fs_delete(inumber);
+	free(buffer);
+	return result;
+}
+
+/*
+Create n files of SCAN_FILE_BLOCKS blocks each, so block mapped files
+need an indirect block, then time a mount of the disk marked unclean,
+which scans the whole inode table, with 1 to 16 threads. The disk is
+mounted without a block cache, so every block the scan needs is read.
+Run it in direct mode to see the disk latency the threads overlap.
+*/
+
+#define SCAN_FILE_BLOCKS 8
+
+static int bench_scan( int n )
+{
+	struct disk_stats before;
+	double start;
+	int i, t, cache, result=1;
+	int *inodes = malloc(n*sizeof(int));
+	char *buffer = malloc(SCAN_FILE_BLOCKS*DISK_BLOCK_SIZE);
+
+	if(!inodes || !buffer) {
+		free(inodes);
+		free(buffer);
+		return 0;
+	}
+
+	memset(buffer,1,SCAN_FILE_BLOCKS*DISK_BLOCK_SIZE);
+	for(i=0;i<n;i++) {
+		inodes[i] = fs_create();
+		if(!inodes[i] || fs_write(inodes[i],buffer,SCAN_FILE_BLOCKS*DISK_BLOCK_SIZE,0)!=SCAN_FILE_BLOCKS*DISK_BLOCK_SIZE) break;
+	}
+	if(i<n) {
+		printf("disk full after %d files\n",i);
+		if(inodes[i]) fs_delete(inodes[i]);
+		n = i;
+	}
+	cache = disk_cache_size();
+
+	for(t=1;t<=16;t*=2) {
+		char what[32];
+		fs_scan_threads(t);
+		if(!fs_unmount() || !fs_mark_unclean()) {
+			result = 0;
+			break;
+		}
+		disk_get_stats(&before);
+		start = now();
+		if(!fs_mount(0)) {
+			result = 0;
+			break;
+		}
+		snprintf(what,sizeof(what),"scan/%d",t);
+		report(what,n,start,&before);
+	}
+	fs_scan_threads(0);
+
+	/* back to the block cache the disk was mounted with */
+	fs_unmount();
+	if(!fs_mount(cache)) {
+		free(inodes);
+		free(buffer);
+		return 0;
+	}
+	if(fs_check()!=0) result = 0;
+
+	for(i=0;i<n;i++) fs_delete(inodes[i]);
+	free(inodes);
+	free(buffer);
+	return result;
+}
+
+/*
+Create THREADS_FILES files of n MB, then read with 1 to 8 threads,
+first each thread its own file and then all of them the same file,
+and print the combined throughput. A stress phase follows: every
+thread creates, writes, verifies and deletes files of its own, and
+fs_check must find the disk consistent afterwards.
+*/
+
+#define THREADS_FILES 8
+#define THREADS_MAX 8
+#define STRESS_ROUNDS 50
+#define STRESS_MAX (256*1024)
+
+struct bench_worker {
+	pthread_t thread;
+	int inumber;
+	int64_t size;
+	int64_t bytes;
+	unsigned seed;
+	int ok;
+};
+
+static void * read_worker( void *arg )
+{
+	struct bench_worker *w = arg;
+	char *buffer = malloc(SEQIO_CHUNK);
+	int64_t offset;
+	int n;
+
+	w->ok = buffer!=0;
+	for(offset=0;w->ok && offset<w->size;offset+=n) {
+		n = fs_read(w->inumber,buffer,SEQIO_CHUNK,offset);
+		if(n<=0) w->ok = 0;
+		else w->bytes += n;
+	}
+	free(buffer);
+	return 0;
+}
+
+static void * stress_worker( void *arg )
+{
+	struct bench_worker *w = arg;
+	char *data = malloc(STRESS_MAX);
+	char *check = malloc(STRESS_MAX);
+	int i, k, length, inumber;
+
+	w->ok = data && check;
+	for(i=0;w->ok && i<STRESS_ROUNDS;i++) {
+		length = 1 + rand_r(&w->seed)%STRESS_MAX;
+		for(k=0;k<length;k++) data[k] = rand_r(&w->seed);
+
+		inumber = fs_create();
+		if(!inumber) {
+			w->ok = 0;
+			break;
+		}
+		if(fs_write(inumber,data,length,0)!=length
+		|| fs_read(inumber,check,length,0)!=length
+		|| memcmp(data,check,length)) {
+			printf("thread data mismatch in inode %d\n",inumber);
+			w->ok = 0;
+		}
+		fs_delete(inumber);
+		w->bytes += length;
+	}
+	free(data);
+	free(check);
+	return 0;
+}
+
+/* run t workers and wait for them, 0 if any failed */
+static int run_workers( struct bench_worker *workers, int t, void *(*func)(void *) )
+{
+	int i, ok=1;
+
+	for(i=0;i<t;i++) {
+		if(pthread_create(&workers[i].thread,0,func,&workers[i])) {
+			workers[i].ok = 0;
+			workers[i].thread = 0;
+		}
+	}
+	for(i=0;i<t;i++) {
+		if(workers[i].thread) pthread_join(workers[i].thread,0);
+		if(!workers[i].ok) ok = 0;
+	}
+	return ok;
+}
+
+static int bench_threads( int n )
+{
+	struct bench_worker workers[THREADS_MAX];
+	int inodes[THREADS_FILES];
+	int64_t size = (int64_t)n*SEQIO_CHUNK;
+	int64_t bytes;
+	int i, t, same, result=1;
+	char *buffer = malloc(SEQIO_CHUNK);
+	double start;
+
+	if(!buffer) return 0;
+	for(i=0;i<SEQIO_CHUNK;i++) buffer[i] = i;
+
+	for(i=0;i<THREADS_FILES;i++) {
+		int64_t offset;
+		inodes[i] = fs_create();
+		for(offset=0;inodes[i] && offset<size;offset+=SEQIO_CHUNK) {
+			if(fs_write(inodes[i],buffer,SEQIO_CHUNK,offset)!=SEQIO_CHUNK) break;
+		}
+		if(!inodes[i] || offset<size) {
+			printf("disk full in file %d\n",i);
+			break;
+		}
+	}
+	free(buffer);
+	if(i<THREADS_FILES) {
+		for(t=0;t<=i && t<THREADS_FILES;t++) {
+			if(inodes[t]) fs_delete(inodes[t]);
+		}
+		return 0;
+	}
+	fs_sync();
+	disk_flush();
+
+	for(same=0;same<=1;same++) {
+		for(t=1;t<=THREADS_MAX;t*=2) {
+			char what[32];
+			memset(workers,0,sizeof(workers));
+			for(i=0;i<t;i++) {
+				workers[i].inumber = inodes[same ? 0 : i%THREADS_FILES];
+				workers[i].size = size;
+			}
+			start = now();
+			if(!run_workers(workers,t,read_worker)) result = 0;
+			for(i=0,bytes=0;i<t;i++) bytes += workers[i].bytes;
+			snprintf(what,sizeof(what),"%s/%d",same ? "same" : "read",t);
+			report_rate(what,bytes,start);
+		}
+	}
+
+	for(i=0;i<THREADS_FILES;i++) fs_delete(inodes[i]);
+
+	memset(workers,0,sizeof(workers));
+	for(i=0;i<THREADS_MAX;i++) workers[i].seed = i+1;
+	start = now();
+	if(!run_workers(workers,THREADS_MAX,stress_worker)) result = 0;
+	for(i=0,bytes=0;i<THREADS_MAX;i++) bytes += workers[i].bytes;
+	report_rate("stress",bytes,start);
+
+	if(fs_check()!=0) {
+		printf("check found mismatches after stress\n");
+		result = 0;
+	}
+	return result;
+}
+
+/*
+Fill the disk with files of 1 to ALLOC_FILE_BLOCKS blocks, then
+fragment its free space by deleting a growing share of them at
+random. At each level, time n queries of the free space index for
+the longest free run, the best fit for 1 to 64 blocks and the first
+run of 1 to 64 blocks from a random block, then n allocations of new
+files through fs_write and fs_sync. Run it on an image of a million
+blocks or more.
+*/
+
+#define ALLOC_FILE_BLOCKS 8
+#define ALLOC_QUERY_MAX 64
+
+static int bench_alloc( int n )
+{
+	static const int levels[] = { 10, 25, 50, 75 };
+	struct disk_stats before;
+	double start;
+	int i, k, level, length, made, nfiles=0, deleted=0, blocks=0, result=1;
+	int capacity = 1024;
+	int *inodes = malloc(capacity*sizeof(int));
+	int *fresh = malloc(n*sizeof(int));
+	char *buffer = malloc(ALLOC_FILE_BLOCKS*DISK_BLOCK_SIZE);
+
+	if(!inodes || !fresh || !buffer) {
+		free(inodes);
+		free(fresh);
+		free(buffer);
+		return 0;
+	}
+	memset(buffer,1,ALLOC_FILE_BLOCKS*DISK_BLOCK_SIZE);
+	srand(1);
+
+	start = now();
+	while(1) {
+		int size = (1+rand()%ALLOC_FILE_BLOCKS)*DISK_BLOCK_SIZE;
+		int inumber = fs_create();
+		if(!inumber) break;
+		if(fs_write(inumber,buffer,size,0)!=size) {
+			fs_delete(inumber);
+			break;
+		}
+		if(nfiles==capacity) {
+			int *more = realloc(inodes,2*capacity*sizeof(int));
+			if(!more) break;
+			inodes = more;
+			capacity *= 2;
+		}
+		inodes[nfiles++] = inumber;
+		blocks += size/DISK_BLOCK_SIZE;
+	}
+	fs_sync();
+	report_rate("fill",(int64_t)blocks*DISK_BLOCK_SIZE,start);
+
+	/* delete in random order */
+	for(i=nfiles-1;i>0;i--) {
+		int j = rand()%(i+1);
+		int t = inodes[i];
+		inodes[i] = inodes[j];
+		inodes[j] = t;
+	}
+
+	for(level=0;level<(int)(sizeof(levels)/sizeof(levels[0]));level++) {
+		char what[32];
+
+		for(;deleted<(int64_t)nfiles*levels[level]/100;deleted++) fs_delete(inodes[deleted]);
+		fs_free_longest(&length);
+		printf("%d%% of files deleted, longest free run %d blocks\n",levels[level],length);
+
+		disk_get_stats(&before);
+		start = now();
+		for(i=0;i<n;i++) fs_free_longest(&length);
+		snprintf(what,sizeof(what),"long/%d",levels[level]);
+		report(what,n,start,&before);
+
+		disk_get_stats(&before);
+		start = now();
+		for(i=0;i<n;i++) fs_free_best(1+rand()%ALLOC_QUERY_MAX,&length);
+		snprintf(what,sizeof(what),"best/%d",levels[level]);
+		report(what,n,start,&before);
+
+		disk_get_stats(&before);
+		start = now();
+		for(i=0;i<n;i++) fs_free_near(rand()%disk_size(),1+rand()%ALLOC_QUERY_MAX,&length);
+		snprintf(what,sizeof(what),"near/%d",levels[level]);
+		report(what,n,start,&before);
+
+		disk_get_stats(&before);
+		start = now();
+		for(i=0,made=0;i<n;i++) {
+			int size = (1+rand()%ALLOC_FILE_BLOCKS)*DISK_BLOCK_SIZE;
+			fresh[made] = fs_create();
+			if(!fresh[made]) break;
+			if(fs_write(fresh[made++],buffer,size,0)!=size) break;
+		}
+		fs_sync();
+		snprintf(what,sizeof(what),"alloc/%d",levels[level]);
+		report(what,i,start,&before);
+
+		for(k=0;k<made;k++) fs_delete(fresh[k]);
+		if(i<n) {
+			printf("disk full after %d files\n",i);
+			result = 0;
+			break;
+		}
+	}
+
+	for(i=deleted;i<nfiles;i++) fs_delete(inodes[i]);
+	free(inodes);
+	free(fresh);
+	free(buffer);
+	return result;
+}
+
+int bench_run( const char *name, int n )
+{
+	if(n<=0) {
+		printf("benchmark size must be positive\n");
+		return 0;
+	}
+
+	if(!strcmp(name,"create")) return bench_create(n);
+	if(!strcmp(name,"seqio")) return bench_seqio(n);
+	if(!strcmp(name,"scan")) return bench_scan(n);
+	if(!strcmp(name,"threads")) return bench_threads(n);
+	if(!strcmp(name,"alloc")) return bench_alloc(n);
+
+	printf("unknown benchmark: %s\n",name);
+	return 0;
+}
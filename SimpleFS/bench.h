@@ -0,0 +1,6 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+int  bench_run( const char *name, int n );
+
+#endif
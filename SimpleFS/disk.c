@@ -1,30 +1,263 @@
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
 
 #include "disk.h"
 
 #define DISK_MAGIC 0xdeadbeef
 
-static FILE *diskfile;
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/*
+Any number of threads may use the disk at once. One lock covers the
+block cache, the buffer pool and the counters; transfers of runs of
+blocks, and the transfers disk_wait issues, run outside it so readers
+on different threads overlap. Each thread has its own submission queue.
+The lock is recursive because the public functions call one another.
+*/
+
+static pthread_mutex_t disk_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+static pthread_mutex_t bounce_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int diskfd=-1;
+static char *diskmap=0;	/* the whole image, in mmap mode */
+static int direct=0;	/* image opened with O_DIRECT */
+
+/*
+Aligned block buffers. O_DIRECT transfers need memory aligned to the
+block size, so the filesystem takes its data buffers from this pool
+rather than the stack. When the pool runs dry a buffer is allocated on
+the spot and freed again on return. Transfers from unaligned memory are
+staged through the bounce area in direct mode.
+*/
+
+#define POOL_BLOCKS 32		/* buffers handed out by disk_buffer_get */
+#define BOUNCE_BLOCKS 64	/* staging for unaligned transfers */
+
+static char *pool=0;
+static char *pool_free[POOL_BLOCKS];
+static int npool_free=0;
+static char *bounce=0;
+
+/*
+Queued transfers. disk_submit_read and disk_submit_write only record a
+transfer; disk_wait merges transfers of neighbouring blocks into one
+vector each, hands all vectors to io_uring with a single system call
+and reaps every completion. Without a ring the same vectors go out with
+preadv/pwritev, so the queue still saves one call per merged transfer.
+*/
+
+#define QUEUE_SIZE 64	/* queued transfers, and entries in the ring */
+
+struct disk_request {
+	int write;
+	int blocknum;
+	int n;
+	char *data;
+};
+
+static __thread struct disk_request queue[QUEUE_SIZE];
+static __thread int nqueued=0;
+
+struct disk_ring {
+	int fd;			/* -1 when io_uring is not used */
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+static struct disk_ring ring = { .fd = -1 };
 static int nblocks=0;
 static int nreads=0;
 static int nwrites=0;
+static int ndiscarded=0;
+static int punch=1;	/* cleared when the host cannot punch holes */
+
+/*
+Write-back block cache. Each slot holds one disk block; slots are found
+through a small chained hash table and evicted with the CLOCK algorithm.
+Dirty blocks only reach the image on eviction, disk_flush or disk_close.
+*/
+
+struct cache_entry {
+	int blocknum;		/* -1 when the slot is unused */
+	int dirty;
+	int referenced;
+	int prefetched;		/* read ahead and not used yet */
+	int next;		/* next slot in the same hash chain, -1 at the end */
+	char *data;
+};
+
+static struct cache_entry *cache=0;
+static char *cache_data=0;
+static int *cache_hash=0;
+static int ncache=0;
+static int hash_mask=0;
+static int clock_hand=0;
+static int nhits=0;
+static int nmisses=0;
+static int nprefetched=0;
+static int nprefetch_hits=0;
+
+/*
+Dirty blocks written back by eviction. A run read from the image outside
+the lock is patched with cached copies afterwards; if a dirty block was
+evicted in between, the image may have changed under the read and the
+run is read again.
+*/
+static unsigned writebacks=0;
+
+/* counters are also bumped outside the lock */
+static void tally( int *counter, int n )
+{
+	__atomic_fetch_add(counter,n,__ATOMIC_RELAXED);
+}
+
+static int ring_init()
+{
+	struct io_uring_params p;
+	int fd;
 
-int disk_init( const char *filename, int n )
+	memset(&p,0,sizeof(p));
+	fd = syscall(__NR_io_uring_setup,QUEUE_SIZE,&p);
+	if(fd<0) return 0;
+
+	ring.sq_ring_size = p.sq_off.array+p.sq_entries*sizeof(unsigned);
+	ring.cq_ring_size = p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+	ring.sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+
+	ring.sq_ring = mmap(0,ring.sq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+	ring.cq_ring = mmap(0,ring.cq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+	ring.sqes = mmap(0,ring.sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+	if(ring.sq_ring==MAP_FAILED || ring.cq_ring==MAP_FAILED || ring.sqes==MAP_FAILED) {
+		if(ring.sq_ring!=MAP_FAILED) munmap(ring.sq_ring,ring.sq_ring_size);
+		if(ring.cq_ring!=MAP_FAILED) munmap(ring.cq_ring,ring.cq_ring_size);
+		if(ring.sqes!=MAP_FAILED) munmap(ring.sqes,ring.sqes_size);
+		close(fd);
+		return 0;
+	}
+
+	ring.sq_tail = (unsigned*)((char*)ring.sq_ring+p.sq_off.tail);
+	ring.sq_mask = (unsigned*)((char*)ring.sq_ring+p.sq_off.ring_mask);
+	ring.sq_array = (unsigned*)((char*)ring.sq_ring+p.sq_off.array);
+	ring.cq_head = (unsigned*)((char*)ring.cq_ring+p.cq_off.head);
+	ring.cq_tail = (unsigned*)((char*)ring.cq_ring+p.cq_off.tail);
+	ring.cq_mask = (unsigned*)((char*)ring.cq_ring+p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe*)((char*)ring.cq_ring+p.cq_off.cqes);
+	ring.fd = fd;
+	return 1;
+}
+
+static void ring_close()
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	if(ring.fd<0) return;
+
+	munmap(ring.sq_ring,ring.sq_ring_size);
+	munmap(ring.cq_ring,ring.cq_ring_size);
+	munmap(ring.sqes,ring.sqes_size);
+	close(ring.fd);
+	ring.fd = -1;
+}
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+static char *aligned_block( size_t n )
+{
+	void *data;
+	if(posix_memalign(&data,DISK_BLOCK_SIZE,n*DISK_BLOCK_SIZE)) return 0;
+	return data;
+}
+
+static int pool_init()
+{
+	int i;
+
+	pool = aligned_block(POOL_BLOCKS);
+	if(!pool) return 0;
+	for(i=0;i<POOL_BLOCKS;i++) pool_free[i] = pool+(size_t)(POOL_BLOCKS-1-i)*DISK_BLOCK_SIZE;
+	npool_free = POOL_BLOCKS;
+	return 1;
+}
+
+int disk_init( const char *filename, int n, int mode )
+{
+	direct = 0;
+	if(mode==DISK_DIRECT) {
+		diskfd = open(filename,O_RDWR|O_CREAT|O_DIRECT,0666);
+		if(diskfd>=0) {
+			direct = 1;
+		} else if(errno==EINVAL) {
+			printf("O_DIRECT is not supported here, using pread\n");
+		}
+	}
+	if(!direct) diskfd = open(filename,O_RDWR|O_CREAT,0666);
+	if(diskfd<0) return 0;
+
+	if(ftruncate(diskfd,(off_t)n*DISK_BLOCK_SIZE)<0 || !pool_init()) {
+		close(diskfd);
+		diskfd = -1;
+		return 0;
+	}
+
+	if(direct) {
+		bounce = aligned_block(BOUNCE_BLOCKS);
+		if(!bounce) {
+			free(pool);
+			pool = 0;
+			close(diskfd);
+			diskfd = -1;
+			return 0;
+		}
+	}
+
+	if(mode==DISK_URING && !ring_init()) {
+		printf("io_uring is not available, using pread\n");
+	}
+
+	if(mode==DISK_MMAP) {
+		diskmap = mmap(0,(size_t)n*DISK_BLOCK_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,diskfd,0);
+		if(diskmap==MAP_FAILED) {
+			diskmap = 0;
+			free(pool);
+			pool = 0;
+			close(diskfd);
+			diskfd = -1;
+			return 0;
+		}
+	}
 
 	nblocks = n;
 	nreads = 0;
 	nwrites = 0;
+	ndiscarded = 0;
+	punch = 1;
+	nhits = 0;
+	nmisses = 0;
+	nprefetched = 0;
+	nprefetch_hits = 0;
 
 	return 1;
 }
@@ -52,41 +285,976 @@ static void sanity_check( int blocknum, const void *data )
 	}
 }
 
+/*
+All image access is positional on a raw fd: no shared file offset and
+no stdio buffer in between. A vector of buffers covering consecutive
+blocks goes out as one preadv/pwritev call per IOV_MAX buffers.
+*/
+
+/* drop the first done bytes of a vector: buffers that are complete go, a partial one is moved into */
+static int iov_advance( struct iovec **iov, int iovcnt, size_t done )
+{
+	while(iovcnt>0 && done>=(*iov)->iov_len) {
+		done -= (*iov)->iov_len;
+		(*iov)++;
+		iovcnt--;
+	}
+	if(iovcnt>0) {
+		(*iov)->iov_base = (char*)(*iov)->iov_base+done;
+		(*iov)->iov_len -= done;
+	}
+	return iovcnt;
+}
+
+static void raw_iov( int write, off_t offset, struct iovec *iov, int iovcnt );
+
+static int iov_aligned( const struct iovec *iov, int iovcnt )
+{
+	int i;
+	for(i=0;i<iovcnt;i++) {
+		if((uintptr_t)iov[i].iov_base%DISK_BLOCK_SIZE || iov[i].iov_len%DISK_BLOCK_SIZE) return 0;
+	}
+	return 1;
+}
+
+/* copy each buffer through the aligned bounce area, BOUNCE_BLOCKS at a time */
+static void bounce_iov( int write, off_t offset, const struct iovec *iov, int iovcnt )
+{
+	int i;
+	pthread_mutex_lock(&bounce_lock);
+	for(i=0;i<iovcnt;i++) {
+		char *data = iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+		while(left>0) {
+			size_t len = left<BOUNCE_BLOCKS*DISK_BLOCK_SIZE ? left : BOUNCE_BLOCKS*DISK_BLOCK_SIZE;
+			struct iovec b = { bounce, len };
+			if(write) memcpy(bounce,data,len);
+			raw_iov(write,offset,&b,1);
+			if(!write) memcpy(data,bounce,len);
+			data += len;
+			offset += len;
+			left -= len;
+		}
+	}
+	pthread_mutex_unlock(&bounce_lock);
+}
+
+static void raw_iov( int write, off_t offset, struct iovec *iov, int iovcnt )
+{
+	/* a mapped image is plain memory */
+	if(diskmap) {
+		int i;
+		for(i=0;i<iovcnt;i++) {
+			if(write) memcpy(diskmap+offset,iov[i].iov_base,iov[i].iov_len);
+			else memcpy(iov[i].iov_base,diskmap+offset,iov[i].iov_len);
+			offset += iov[i].iov_len;
+		}
+		return;
+	}
+
+	if(direct && !iov_aligned(iov,iovcnt)) {
+		bounce_iov(write,offset,iov,iovcnt);
+		return;
+	}
+
+	while(iovcnt>0) {
+		int cnt = iovcnt<IOV_MAX ? iovcnt : IOV_MAX;
+		ssize_t done = write ? pwritev(diskfd,iov,cnt,offset) : preadv(diskfd,iov,cnt,offset);
+
+		if(done<0 && errno==EINTR) continue;
+		if(done<=0) {
+			printf("ERROR: couldn't access simulated disk: %s\n",done<0 ? strerror(errno) : "short transfer");
+			abort();
+		}
+		offset += done;
+		iovcnt = iov_advance(&iov,iovcnt,done);
+	}
+}
+
+#define IOV_CHUNK 256
+
+/*
+Sparse image. Runs of all-zero blocks are not written but punched out
+of the image, so the host keeps no space for them and the write costs
+no data transfer. The zero test ors a block together 256 bytes at a
+time in vector registers and gives up at the first stretch that is not
+zero, so a block of data costs one step. punch is cleared the first
+time the host filesystem refuses a hole; from then on every write goes
+out as it is.
+*/
+
+#define ZERO_STRIDE 256
+
+typedef uint64_t zero_vec __attribute__((vector_size(32),aligned(1),may_alias));
+
+static char zeroblock[DISK_BLOCK_SIZE] __attribute__((aligned(DISK_BLOCK_SIZE)));
+
+static int block_is_zero( const char *data )
+{
+	int i, j;
+	for(i=0;i<DISK_BLOCK_SIZE;i+=ZERO_STRIDE) {
+		const zero_vec *v = (const zero_vec*)(data+i);
+		zero_vec acc = v[0];
+		for(j=1;j<ZERO_STRIDE/(int)sizeof(zero_vec);j++) acc |= v[j];
+		if(acc[0]|acc[1]|acc[2]|acc[3]) return 0;
+	}
+	return 1;
+}
+
+static int punch_hole( off_t offset, off_t len )
+{
+	if(!__atomic_load_n(&punch,__ATOMIC_RELAXED)) return 0;
+	if(!fallocate(diskfd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,offset,len)) return 1;
+	if(errno==EOPNOTSUPP || errno==ENOSYS) __atomic_store_n(&punch,0,__ATOMIC_RELAXED);
+	return 0;
+}
+
+/* len bytes of zeroes at offset: a hole if the host allows one, zero blocks otherwise */
+static void write_zeroes( off_t offset, off_t len )
+{
+	struct iovec iov[IOV_CHUNK];
+	int i, n = len/DISK_BLOCK_SIZE;
+
+	if(punch_hole(offset,len)) {
+		tally(&ndiscarded,n);
+		return;
+	}
+
+	for(i=0;i<IOV_CHUNK;i++) {
+		iov[i].iov_base = zeroblock;
+		iov[i].iov_len = DISK_BLOCK_SIZE;
+	}
+	for(i=0;i<n;i+=IOV_CHUNK) {
+		int cnt = n-i<IOV_CHUNK ? n-i : IOV_CHUNK;
+		raw_iov(1,offset+(off_t)i*DISK_BLOCK_SIZE,iov,cnt);
+	}
+	tally(&nwrites,n);
+}
+
+/* write a vector of whole blocks at offset, leaving holes where blocks are all zero */
+static void raw_write_sparse( off_t offset, struct iovec *iov, int iovcnt )
+{
+	struct iovec out[IOV_CHUNK];
+	int i, nout=0, written=0;
+	off_t start=offset, zeroes=0;
+	size_t k;
+
+	if(!__atomic_load_n(&punch,__ATOMIC_RELAXED)) {
+		for(i=0;i<iovcnt;i++) written += iov[i].iov_len/DISK_BLOCK_SIZE;
+		raw_iov(1,offset,iov,iovcnt);
+		tally(&nwrites,written);
+		return;
+	}
+
+	for(i=0;i<iovcnt;i++) {
+		for(k=0;k<iov[i].iov_len;k+=DISK_BLOCK_SIZE) {
+			char *data = (char*)iov[i].iov_base+k;
+
+			if(block_is_zero(data)) {
+				/* the data gathered so far ends here */
+				if(nout) raw_iov(1,start,out,nout);
+				nout = 0;
+				zeroes += DISK_BLOCK_SIZE;
+			} else {
+				if(zeroes) write_zeroes(offset-zeroes,zeroes);
+				zeroes = 0;
+
+				if(nout && (char*)out[nout-1].iov_base+out[nout-1].iov_len==data) {
+					out[nout-1].iov_len += DISK_BLOCK_SIZE;
+				} else {
+					if(nout==IOV_CHUNK) {
+						raw_iov(1,start,out,nout);
+						nout = 0;
+					}
+					if(!nout) start = offset;
+					out[nout].iov_base = data;
+					out[nout].iov_len = DISK_BLOCK_SIZE;
+					nout++;
+				}
+				written++;
+			}
+			offset += DISK_BLOCK_SIZE;
+		}
+	}
+
+	if(nout) raw_iov(1,start,out,nout);
+	if(zeroes) write_zeroes(offset-zeroes,zeroes);
+	tally(&nwrites,written);
+}
+
+static void raw_read( int blocknum, char *data )
+{
+	struct iovec iov = { data, DISK_BLOCK_SIZE };
+	raw_iov(0,(off_t)blocknum*DISK_BLOCK_SIZE,&iov,1);
+	tally(&nreads,1);
+}
+
+static void raw_write( int blocknum, const char *data )
+{
+	struct iovec iov = { (char*)data, DISK_BLOCK_SIZE };
+	raw_write_sparse((off_t)blocknum*DISK_BLOCK_SIZE,&iov,1);
+}
+
+static int cache_lookup( int blocknum )
+{
+	int slot = cache_hash[blocknum&hash_mask];
+	while(slot>=0 && cache[slot].blocknum!=blocknum) slot = cache[slot].next;
+	return slot;
+}
+
+static void cache_unlink( int slot )
+{
+	int *link = &cache_hash[cache[slot].blocknum&hash_mask];
+	while(*link!=slot) link = &cache[*link].next;
+	*link = cache[slot].next;
+}
+
+/* pick a slot with CLOCK, writing back its old contents if dirty */
+static int cache_evict()
+{
+	while(1) {
+		int slot = clock_hand;
+		clock_hand = (clock_hand+1)%ncache;
+
+		if(cache[slot].blocknum<0) return slot;
+
+		if(cache[slot].referenced) {
+			cache[slot].referenced = 0;
+			continue;
+		}
+
+		if(cache[slot].dirty) {
+			raw_write(cache[slot].blocknum,cache[slot].data);
+			writebacks++;
+		}
+		cache_unlink(slot);
+		cache[slot].blocknum = -1;
+		cache[slot].dirty = 0;
+		cache[slot].prefetched = 0;
+		return slot;
+	}
+}
+
+static int cache_insert( int blocknum )
+{
+	int slot = cache_evict();
+	int *head = &cache_hash[blocknum&hash_mask];
+
+	cache[slot].blocknum = blocknum;
+	cache[slot].dirty = 0;
+	cache[slot].referenced = 1;
+	cache[slot].prefetched = 0;
+	cache[slot].next = *head;
+	*head = slot;
+	return slot;
+}
+
 void disk_read( int blocknum, char *data )
 {
 	sanity_check(blocknum,data);
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	pthread_mutex_lock(&disk_lock);
+	if(!ncache) {
+		pthread_mutex_unlock(&disk_lock);
+		raw_read(blocknum,data);
+		return;
+	}
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
+	int slot = cache_lookup(blocknum);
+	if(slot>=0) {
+		nhits++;
+		if(cache[slot].prefetched) {
+			cache[slot].prefetched = 0;
+			nprefetch_hits++;
+		}
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+		nmisses++;
+		slot = cache_insert(blocknum);
+		raw_read(blocknum,cache[slot].data);
 	}
+
+	cache[slot].referenced = 1;
+	memcpy(data,cache[slot].data,DISK_BLOCK_SIZE);
+	pthread_mutex_unlock(&disk_lock);
 }
 
 void disk_write( int blocknum, const char *data )
 {
 	sanity_check(blocknum,data);
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	pthread_mutex_lock(&disk_lock);
+	if(!ncache) {
+		pthread_mutex_unlock(&disk_lock);
+		raw_write(blocknum,data);
+		return;
+	}
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
-	} else {
+	/* a whole-block write never needs the old contents */
+	int slot = cache_lookup(blocknum);
+	if(slot<0) slot = cache_insert(blocknum);
+
+	cache[slot].referenced = 1;
+	cache[slot].dirty = 1;
+	memcpy(cache[slot].data,data,DISK_BLOCK_SIZE);
+	pthread_mutex_unlock(&disk_lock);
+}
+
+/*
+disk_pread takes a cached copy if there is one but leaves the cache as
+it is, and otherwise reads the image with a positional read of its own,
+outside the lock. A block that is not cached has no newer copy than
+the one in the image.
+*/
+
+void disk_pread( int blocknum, char *data )
+{
+	sanity_check(blocknum,data);
+
+	pthread_mutex_lock(&disk_lock);
+	int slot = ncache ? cache_lookup(blocknum) : -1;
+	if(slot>=0) memcpy(data,cache[slot].data,DISK_BLOCK_SIZE);
+	pthread_mutex_unlock(&disk_lock);
+	if(slot>=0) return;
+
+	/* the bounce area is shared, stage unaligned reads on this thread's stack */
+	char aligned[DISK_BLOCK_SIZE] __attribute__((aligned(DISK_BLOCK_SIZE)));
+	int unaligned = direct && (uintptr_t)data%DISK_BLOCK_SIZE;
+	struct iovec iov = { unaligned ? aligned : data, DISK_BLOCK_SIZE };
+
+	raw_iov(0,(off_t)blocknum*DISK_BLOCK_SIZE,&iov,1);
+	if(unaligned) memcpy(data,aligned,DISK_BLOCK_SIZE);
+	tally(&nreads,1);
+}
+
+/*
+Runs of consecutive blocks bypass the cache and go to the image as one
+request, from one flat buffer (disk_read_blocks) or from a scatter list
+with one buffer per block (disk_readv). Cached copies stay coherent: a read takes any cached (possibly dirty)
+block over the image, and a write refreshes the cached copy before the image is written.
+*/
+
+/* replace blocks read from the image with any newer cached copy. return 0, leaving data alone, if a dirty block
+was written back since writebacks was gen: the read may have missed it and has to be done again */
+static int cache_merge( unsigned gen, int blocknum, int n, char *data[] )
+{
+	int i;
+
+	pthread_mutex_lock(&disk_lock);
+	if(writebacks!=gen) {
+		pthread_mutex_unlock(&disk_lock);
+		return 0;
+	}
+	for(i=0;i<n && ncache;i++) {
+		int slot = cache_lookup(blocknum+i);
+		if(slot>=0) memcpy(data[i],cache[slot].data,DISK_BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&disk_lock);
+	return 1;
+}
+
+/* the same for a flat buffer of n blocks */
+static int cache_merge_run( unsigned gen, int blocknum, int n, char *data )
+{
+	int i;
+
+	pthread_mutex_lock(&disk_lock);
+	if(writebacks!=gen) {
+		pthread_mutex_unlock(&disk_lock);
+		return 0;
+	}
+	for(i=0;i<n && ncache;i++) {
+		int slot = cache_lookup(blocknum+i);
+		if(slot>=0) memcpy(data+(size_t)i*DISK_BLOCK_SIZE,cache[slot].data,DISK_BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&disk_lock);
+	return 1;
+}
+
+static unsigned writeback_gen()
+{
+	return __atomic_load_n(&writebacks,__ATOMIC_ACQUIRE);
+}
+
+/* the image now holds these blocks, so cached copies are refreshed and clean */
+static void cache_refresh( int blocknum, int n, const char *data[] )
+{
+	int i;
+
+	pthread_mutex_lock(&disk_lock);
+	for(i=0;i<n && ncache;i++) {
+		int slot = cache_lookup(blocknum+i);
+		if(slot<0) continue;
+		memcpy(cache[slot].data,data[i],DISK_BLOCK_SIZE);
+		cache[slot].dirty = 0;
+	}
+	pthread_mutex_unlock(&disk_lock);
+}
+
+/* the same for a flat buffer of n blocks */
+static void cache_refresh_run( int blocknum, int n, const char *data )
+{
+	int i;
+
+	pthread_mutex_lock(&disk_lock);
+	for(i=0;i<n && ncache;i++) {
+		int slot = cache_lookup(blocknum+i);
+		if(slot<0) continue;
+		memcpy(cache[slot].data,data+(size_t)i*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE);
+		cache[slot].dirty = 0;
+	}
+	pthread_mutex_unlock(&disk_lock);
+}
+
+void disk_readv( int blocknum, int n, char *data[] )
+{
+	struct iovec iov[IOV_CHUNK];
+	int i, done;
+
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+n-1,data);
+
+	unsigned gen;
+	do {
+		gen = writeback_gen();
+		for(done=0;done<n;done+=IOV_CHUNK) {
+			int cnt = n-done<IOV_CHUNK ? n-done : IOV_CHUNK;
+			for(i=0;i<cnt;i++) {
+				iov[i].iov_base = data[done+i];
+				iov[i].iov_len = DISK_BLOCK_SIZE;
+			}
+			raw_iov(0,(off_t)(blocknum+done)*DISK_BLOCK_SIZE,iov,cnt);
+		}
+		tally(&nreads,n);
+	} while(!cache_merge(gen,blocknum,n,data));
+}
+
+void disk_writev( int blocknum, int n, const char *data[] )
+{
+	struct iovec iov[IOV_CHUNK];
+	int i, done;
+
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+n-1,data);
+
+	/* a cached copy written back later must not overwrite the new data */
+	cache_refresh(blocknum,n,data);
+
+	for(done=0;done<n;done+=IOV_CHUNK) {
+		int cnt = n-done<IOV_CHUNK ? n-done : IOV_CHUNK;
+		for(i=0;i<cnt;i++) {
+			iov[i].iov_base = (char*)data[done+i];
+			iov[i].iov_len = DISK_BLOCK_SIZE;
+		}
+		raw_write_sparse((off_t)(blocknum+done)*DISK_BLOCK_SIZE,iov,cnt);
+	}
+}
+
+void disk_read_blocks( int blocknum, int n, char *data )
+{
+	unsigned gen;
+
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+n-1,data);
+
+	do {
+		struct iovec iov = { data, (size_t)n*DISK_BLOCK_SIZE };
+		gen = writeback_gen();
+		raw_iov(0,(off_t)blocknum*DISK_BLOCK_SIZE,&iov,1);
+		tally(&nreads,n);
+	} while(!cache_merge_run(gen,blocknum,n,data));
+}
+
+void disk_write_blocks( int blocknum, int n, const char *data )
+{
+	struct iovec iov = { (char*)data, (size_t)n*DISK_BLOCK_SIZE };
+
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+n-1,data);
+
+	cache_refresh_run(blocknum,n,data);
+	raw_write_sparse((off_t)blocknum*DISK_BLOCK_SIZE,&iov,1);
+}
+
+/*
+Discarding punches blocks out of the image: the file keeps its size,
+the host frees the space, and the blocks read as zeroes. Cached copies
+are zeroed and made clean under the same lock as the punch, so no
+write-back can fill the hole again. Returns 0, changing nothing, when
+the host filesystem cannot punch holes.
+*/
+
+int disk_discard( int blocknum, int n )
+{
+	int i;
+
+	sanity_check(blocknum,&nblocks);
+	sanity_check(blocknum+n-1,&nblocks);
+
+	/* this thread's queued writes must not land in the hole later */
+	disk_wait();
+
+	pthread_mutex_lock(&disk_lock);
+	if(!punch_hole((off_t)blocknum*DISK_BLOCK_SIZE,(off_t)n*DISK_BLOCK_SIZE)) {
+		pthread_mutex_unlock(&disk_lock);
+		return 0;
+	}
+	for(i=0;i<ncache;i++) {
+		if(cache[i].blocknum<blocknum || cache[i].blocknum>=blocknum+n) continue;
+		memset(cache[i].data,0,DISK_BLOCK_SIZE);
+		cache[i].dirty = 0;
+	}
+	pthread_mutex_unlock(&disk_lock);
+	tally(&ndiscarded,n);
+	return 1;
+}
+
+void disk_submit_read( int blocknum, int n, char *data )
+{
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+n-1,data);
+
+	if(nqueued==QUEUE_SIZE) disk_wait();
+	queue[nqueued].write = 0;
+	queue[nqueued].blocknum = blocknum;
+	queue[nqueued].n = n;
+	queue[nqueued].data = data;
+	nqueued++;
+}
+
+void disk_submit_write( int blocknum, int n, const char *data )
+{
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+n-1,data);
+
+	if(nqueued==QUEUE_SIZE) disk_wait();
+	queue[nqueued].write = 1;
+	queue[nqueued].blocknum = blocknum;
+	queue[nqueued].n = n;
+	queue[nqueued].data = (char*)data;
+	nqueued++;
+
+	/* cached copies take the new contents now, the image gets them by disk_wait */
+	cache_refresh_run(blocknum,n,data);
+}
+
+/* a merged transfer: queued requests first..first+count-1 as one vector */
+struct disk_group {
+	int first;
+	int count;
+	size_t bytes;
+};
+
+/*
+Hand every group to the ring at once, then reap all completions. The
+kernel may take fewer entries than offered, and then returns without
+waiting; the rest are offered again each time the loop waits. Short
+transfers are finished with preadv/pwritev.
+*/
+static void ring_run( struct disk_group *groups, int ngroups, struct iovec *iov )
+{
+	unsigned tail = *ring.sq_tail;
+	int i, ret, submitted, done=0;
+
+	for(i=0;i<ngroups;i++) {
+		struct disk_request *r = &queue[groups[i].first];
+		unsigned index = tail & *ring.sq_mask;
+		struct io_uring_sqe *sqe = &ring.sqes[index];
+
+		memset(sqe,0,sizeof(*sqe));
+		sqe->opcode = r->write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->fd = diskfd;
+		sqe->addr = (unsigned long)&iov[groups[i].first];
+		sqe->len = groups[i].count;
+		sqe->off = (off_t)r->blocknum*DISK_BLOCK_SIZE;
+		sqe->user_data = i;
+		ring.sq_array[index] = index;
+		tail++;
+	}
+	__atomic_store_n(ring.sq_tail,tail,__ATOMIC_RELEASE);
+
+	ret = syscall(__NR_io_uring_enter,ring.fd,ngroups,ngroups,IORING_ENTER_GETEVENTS,0,0);
+	if(ret<0 && errno!=EINTR && errno!=EAGAIN && errno!=EBUSY) {
 		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
 		abort();
 	}
+	submitted = ret>0 ? ret : 0;
+
+	while(done<ngroups) {
+		unsigned head = *ring.cq_head;
+
+		if(head==__atomic_load_n(ring.cq_tail,__ATOMIC_ACQUIRE)) {
+			ret = syscall(__NR_io_uring_enter,ring.fd,ngroups-submitted,1,IORING_ENTER_GETEVENTS,0,0);
+			if(ret<0 && errno!=EINTR && errno!=EAGAIN && errno!=EBUSY) {
+				printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+				abort();
+			}
+			if(ret>0) submitted += ret;
+			continue;
+		}
+
+		struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+		struct disk_group *g = &groups[cqe->user_data];
+		struct disk_request *r = &queue[g->first];
+		int res = cqe->res;
+		__atomic_store_n(ring.cq_head,head+1,__ATOMIC_RELEASE);
+
+		if(res<0) {
+			printf("ERROR: couldn't access simulated disk: %s\n",strerror(-res));
+			abort();
+		}
+
+		if((size_t)res<g->bytes) {
+			struct iovec *rest = &iov[g->first];
+			int cnt = iov_advance(&rest,g->count,res);
+			raw_iov(r->write,(off_t)r->blocknum*DISK_BLOCK_SIZE+res,rest,cnt);
+		}
+		done++;
+	}
+}
+
+/* whether request r overlaps one of queued requests first..last-1, and one of the two writes */
+static int queue_conflict( int first, int last, const struct disk_request *r )
+{
+	int i;
+
+	for(i=first;i<last;i++) {
+		const struct disk_request *q = &queue[i];
+		if((q->write || r->write) && q->blocknum<r->blocknum+r->n && r->blocknum<q->blocknum+q->n) return 1;
+	}
+	return 0;
+}
+
+/*
+Carry out queued requests first..last-1 and wait for them. None of
+them overlaps another one that writes, so they may complete in any
+order.
+*/
+static void queue_run( int first, int last, unsigned gen, struct iovec *iov )
+{
+	struct disk_group groups[QUEUE_SIZE];
+	int i, ngroups=0;
+
+	/* one vector per run of requests in the same direction on neighbouring blocks */
+	for(i=first;i<last;i++) {
+		struct disk_request *r = &queue[i];
+		struct disk_group *g = ngroups ? &groups[ngroups-1] : 0;
+
+		iov[i].iov_base = r->data;
+		iov[i].iov_len = (size_t)r->n*DISK_BLOCK_SIZE;
+
+		if(g && queue[i-1].write==r->write && queue[i-1].blocknum+queue[i-1].n==r->blocknum && g->count<IOV_MAX) {
+			g->count++;
+			g->bytes += iov[i].iov_len;
+		} else {
+			groups[ngroups].first = i;
+			groups[ngroups].count = 1;
+			groups[ngroups].bytes = iov[i].iov_len;
+			ngroups++;
+		}
+	}
+
+	/* the ring is shared by all threads, a thread that finds it busy uses preadv/pwritev */
+	if(ring.fd>=0 && !diskmap && !pthread_mutex_trylock(&ring_lock)) {
+		ring_run(groups,ngroups,iov);
+		pthread_mutex_unlock(&ring_lock);
+	} else {
+		for(i=0;i<ngroups;i++) {
+			struct disk_request *r = &queue[groups[i].first];
+			raw_iov(r->write,(off_t)r->blocknum*DISK_BLOCK_SIZE,&iov[groups[i].first],groups[i].count);
+		}
+	}
+
+	/* reads are patched with cached copies, or done again if that is too late */
+	for(i=first;i<last;i++) {
+		struct disk_request *r = &queue[i];
+
+		if(r->write) {
+			tally(&nwrites,r->n);
+			continue;
+		}
+
+		tally(&nreads,r->n);
+		if(!cache_merge_run(gen,r->blocknum,r->n,r->data)) disk_read_blocks(r->blocknum,r->n,r->data);
+	}
+}
+
+/*
+Requests on the same blocks reach the image in the order they were
+queued. The queue is carried out in batches: a request that overlaps
+an earlier one of the batch, with a write on either side, first waits
+for the batch to complete. Writes of nothing but zero blocks are
+punched out of the image instead, at their place in that order.
+*/
+void disk_wait()
+{
+	struct iovec iov[QUEUE_SIZE];
+	int i, n, first;
+
+	if(!nqueued) return;
+	unsigned gen = writeback_gen();
+
+	for(i=0,n=0,first=0;i<nqueued;i++) {
+		struct disk_request r = queue[i];
+		int zero = r.write;
+		int k;
+
+		if(queue_conflict(first,n,&r)) {
+			queue_run(first,n,gen,iov);
+			first = n;
+		}
+
+		for(k=0;k<r.n && zero;k++) zero = block_is_zero(r.data+(size_t)k*DISK_BLOCK_SIZE);
+		if(zero && punch_hole((off_t)r.blocknum*DISK_BLOCK_SIZE,(off_t)r.n*DISK_BLOCK_SIZE)) {
+			tally(&ndiscarded,r.n);
+			continue;
+		}
+		queue[n++] = r;
+	}
+	queue_run(first,n,gen,iov);
+	nqueued = 0;
+}
+
+/*
+In mmap mode a caller can work on n consecutive blocks in place. The
+pointer stays valid until the disk is closed; disk_unmap_block only
+accounts for the access. Outside mmap mode there is nothing to map.
+*/
+
+/*
+Read ahead into the cache. The blocks of the run that are not cached
+yet are loaded into fresh slots with one vectored read per stretch of
+missing blocks. A slot loaded this way counts as a readahead hit the
+first time disk_read uses it. At most half the cache is loaded at once.
+The new slots are marked referenced, and the CLOCK hand would have to
+pass them twice, so a prefetch never evicts the blocks it loads itself.
+Blocks an earlier prefetch loaded get no such protection: once a window
+comes near half the cache, the next one may evict them before they are
+used, and they are read again like any other miss.
+*/
+
+int disk_prefetch( int blocknum, int n )
+{
+	struct iovec iov[IOV_CHUNK];
+	int i, start=0, count=0, loaded=0;
+
+	/* queued writes must reach the image before it is read */
+	disk_wait();
+
+	pthread_mutex_lock(&disk_lock);
+	if(n>ncache/2) n = ncache/2;
+	if(n<=0) {
+		pthread_mutex_unlock(&disk_lock);
+		return 0;
+	}
+
+	sanity_check(blocknum,cache);
+	sanity_check(blocknum+n-1,cache);
+
+	for(i=0;i<n;i++) {
+		int slot = cache_lookup(blocknum+i);
+		if(slot<0) {
+			if(!count) start = blocknum+i;
+			slot = cache_insert(blocknum+i);
+			cache[slot].prefetched = 1;
+			iov[count].iov_base = cache[slot].data;
+			iov[count].iov_len = DISK_BLOCK_SIZE;
+			count++;
+			if(count<IOV_CHUNK && i<n-1) continue;
+		}
+		if(count) {
+			raw_iov(0,(off_t)start*DISK_BLOCK_SIZE,iov,count);
+			tally(&nreads,count);
+			loaded += count;
+			count = 0;
+		}
+	}
+
+	nprefetched += loaded;
+	pthread_mutex_unlock(&disk_lock);
+	return loaded;
+}
+
+char *disk_map_block( int blocknum, int n )
+{
+	if(!diskmap) return 0;
+
+	sanity_check(blocknum,diskmap);
+	sanity_check(blocknum+n-1,diskmap);
+	return diskmap+(size_t)blocknum*DISK_BLOCK_SIZE;
+}
+
+void disk_unmap_block( int n, int dirty )
+{
+	if(dirty) tally(&nwrites,n);
+	else tally(&nreads,n);
+}
+
+static int compare_slots( const void *a, const void *b )
+{
+	return cache[*(const int*)a].blocknum - cache[*(const int*)b].blocknum;
+}
+
+void disk_flush()
+{
+	int i, ndirty=0;
+	int *slots;
+
+	disk_wait();
+
+	if(diskmap) {
+		if(msync(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE,MS_SYNC)<0) {
+			printf("ERROR: couldn't flush simulated disk: %s\n",strerror(errno));
+			abort();
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&disk_lock);
+	if(!ncache) {
+		pthread_mutex_unlock(&disk_lock);
+		return;
+	}
+
+	slots = malloc(ncache*sizeof(int));
+	if(!slots) {
+		printf("ERROR: couldn't flush block cache: %s\n",strerror(errno));
+		abort();
+	}
+
+	for(i=0;i<ncache;i++) {
+		if(cache[i].blocknum>=0 && cache[i].dirty) slots[ndirty++] = i;
+	}
+
+	/* write back in block order so the image sees one ascending sweep */
+	qsort(slots,ndirty,sizeof(int),compare_slots);
+
+	for(i=0;i<ndirty;i++) {
+		raw_write(cache[slots[i]].blocknum,cache[slots[i]].data);
+		cache[slots[i]].dirty = 0;
+	}
+
+	free(slots);
+	pthread_mutex_unlock(&disk_lock);
+}
+
+int disk_cache_init( int n )
+{
+	int i, nhash=1;
+
+	pthread_mutex_lock(&disk_lock);
+	disk_flush();
+	free(cache);
+	free(cache_data);
+	free(cache_hash);
+	cache = 0;
+	cache_data = 0;
+	cache_hash = 0;
+	ncache = 0;
+	clock_hand = 0;
+
+	/* the mapping already keeps the image in memory */
+	if(n<=0 || diskmap) {
+		pthread_mutex_unlock(&disk_lock);
+		return 1;
+	}
+
+	while(nhash<2*n) nhash *= 2;
+
+	cache = malloc(n*sizeof(struct cache_entry));
+	cache_data = aligned_block(n);
+	cache_hash = malloc(nhash*sizeof(int));
+	if(!cache || !cache_data || !cache_hash) {
+		free(cache);
+		free(cache_data);
+		free(cache_hash);
+		cache = 0;
+		cache_data = 0;
+		cache_hash = 0;
+		pthread_mutex_unlock(&disk_lock);
+		return 0;
+	}
+
+	for(i=0;i<n;i++) {
+		cache[i].blocknum = -1;
+		cache[i].dirty = 0;
+		cache[i].referenced = 0;
+		cache[i].prefetched = 0;
+		cache[i].next = -1;
+		cache[i].data = cache_data+(size_t)i*DISK_BLOCK_SIZE;
+	}
+	for(i=0;i<nhash;i++) cache_hash[i] = -1;
+
+	ncache = n;
+	hash_mask = nhash-1;
+	pthread_mutex_unlock(&disk_lock);
+	return 1;
+}
+
+int disk_cache_size()
+{
+	return ncache;
+}
+
+void disk_get_stats( struct disk_stats *s )
+{
+	pthread_mutex_lock(&disk_lock);
+	s->reads = nreads;
+	s->writes = nwrites;
+	s->discarded = ndiscarded;
+	s->hits = nhits;
+	s->misses = nmisses;
+	s->prefetched = nprefetched;
+	s->prefetch_hits = nprefetch_hits;
+	pthread_mutex_unlock(&disk_lock);
+}
+
+char *disk_buffer_get()
+{
+	char *data=0;
+
+	pthread_mutex_lock(&disk_lock);
+	if(npool_free>0) data = pool_free[--npool_free];
+	pthread_mutex_unlock(&disk_lock);
+	if(data) return data;
+
+	data = aligned_block(1);
+	if(!data) {
+		printf("ERROR: couldn't allocate block buffer: %s\n",strerror(errno));
+		abort();
+	}
+	return data;
+}
+
+void disk_buffer_put( char *data )
+{
+	if(pool && data>=pool && data<pool+(size_t)POOL_BLOCKS*DISK_BLOCK_SIZE) {
+		pthread_mutex_lock(&disk_lock);
+		pool_free[npool_free++] = data;
+		pthread_mutex_unlock(&disk_lock);
+	} else {
+		free(data);
+	}
 }
 
 void disk_close()
 {
-	if(diskfile) {
+	if(diskfd>=0) {
+		disk_cache_init(0);
 		printf("%d disk block reads\n",nreads);
 		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
+		printf("%d disk blocks discarded\n",ndiscarded);
+		printf("%d cache hits\n",nhits);
+		printf("%d cache misses\n",nmisses);
+		if(diskmap) munmap(diskmap,(size_t)nblocks*DISK_BLOCK_SIZE);
+		diskmap = 0;
+		free(pool);
+		free(bounce);
+		pool = 0;
+		bounce = 0;
+		npool_free = 0;
+		ring_close();
+		close(diskfd);
+		diskfd = -1;
 	}
 }
 
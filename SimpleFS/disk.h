@@ -3,11 +3,50 @@
 
 #define DISK_BLOCK_SIZE 4096
 
-int  disk_init( const char *filename, int nblocks );
+/* image access modes for disk_init */
+#define DISK_PREAD 0	/* pread/pwrite on the image file */
+#define DISK_MMAP  1	/* image mapped into memory, synced with msync */
+#define DISK_URING 2	/* queued transfers go through io_uring, pread if it is unavailable */
+#define DISK_DIRECT 3	/* image opened with O_DIRECT, bypassing the host page cache */
+
+struct disk_stats {
+	int reads;
+	int writes;
+	int discarded;		/* blocks punched out of the image instead of written */
+	int hits;
+	int misses;
+	int prefetched;		/* blocks read ahead into the cache */
+	int prefetch_hits;	/* of those, blocks a read used */
+};
+
+int  disk_init( const char *filename, int nblocks, int mode );
 int  disk_size();
 void disk_read( int blocknum, char *data );
+void disk_pread( int blocknum, char *data );
 void disk_write( int blocknum, const char *data );
+void disk_read_blocks( int blocknum, int n, char *data );
+void disk_write_blocks( int blocknum, int n, const char *data );
+void disk_readv( int blocknum, int n, char *data[] );
+void disk_writev( int blocknum, int n, const char *data[] );
+int  disk_discard( int blocknum, int n );
+
+void disk_submit_read( int blocknum, int n, char *data );
+void disk_submit_write( int blocknum, int n, const char *data );
+void disk_wait();
+
+int  disk_prefetch( int blocknum, int n );
+
+char *disk_map_block( int blocknum, int n );
+void disk_unmap_block( int n, int dirty );
+
+char *disk_buffer_get();
+void disk_buffer_put( char *data );
 void disk_close();
 
+int  disk_cache_init( int nblocks );
+int  disk_cache_size();
+void disk_flush();
+void disk_get_stats( struct disk_stats *s );
+
 
 #endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 
 #include "fs.h"
 #include "disk.h"
@@ -7,126 +8,1010 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #define FS_MAGIC           0xf0f03410
-#define INODES_PER_BLOCK   128
+#define FS_VERSION_MASK    0xffff  // inode format in the low bits of the superblock version
+#define FS_FEATURE_INLINE  0x10000 // feature bits above it. inline files, see inode_create
+#define FS_FEATURE_LAZY_ITABLE 0x20000 // inode table not all written yet, see itable_init
+#define FS_FEATURES        (FS_FEATURE_INLINE | FS_FEATURE_LAZY_ITABLE)
+#define INODES_PER_BLOCK   32
+#define CLASSIC_INODES_PER_BLOCK 128
 #define POINTERS_PER_INODE 5
 #define POINTERS_PER_BLOCK 1024
+#define INODE_EXTENTS      13
+#define INODE_INLINE       112     // bytes of file data a 128-byte inode holds in place of its map
+#define EXTENTS_PER_BLOCK  (DISK_BLOCK_SIZE / 8)
+#define OWNERS_PER_BLOCK   (DISK_BLOCK_SIZE / 8)
+#define MAX_EXTENTS        (INODE_EXTENTS + EXTENTS_PER_BLOCK)
+#define BITS_PER_BLOCK     (DISK_BLOCK_SIZE * 8)
+#define FS_MAX_OPEN        32
+#define MAX_FILE_BLOCKS    (POINTERS_PER_INODE + POINTERS_PER_BLOCK)
+#define DIND_BLOCKS        (POINTERS_PER_BLOCK * POINTERS_PER_BLOCK)
+#define TIND_BLOCKS        (DIND_BLOCKS * POINTERS_PER_BLOCK)
+#define MAX_INDIRECT_BLOCKS (MAX_FILE_BLOCKS + DIND_BLOCKS + TIND_BLOCKS)
+#define MAX_EXTENT_BLOCKS  (1 << 30)
+#define POINTER_LEVELS     3
+#define MAX_IO_BLOCKS      1024    // largest run fs_pread and fs_pwrite send to the disk as one request
+#define READAHEAD_STREAMS  16      // inodes whose sequential reads are tracked at once
+#define READAHEAD_MIN      4       // first readahead window, in blocks
+#define READAHEAD_MAX      256     // largest readahead window, in blocks
+#define DEFRAG_WINDOW      MAX_IO_BLOCKS   // blocks defrag writes in one sequential request
+#define DELAY_FILES        16      // inodes with delayed writes at once
+#define DELAY_MAX_BLOCKS   MAX_IO_BLOCKS   // largest delayed write buffer of one inode
+#define DELAY_BUDGET       4096    // blocks in all delayed write buffers together
+#define SCAN_THREADS_MAX   16      // threads scanning the inode table
+#define INODE_LOCKS        64      // inode locks, shared by inode numbers that are equal modulo this
+#define BLOCK_GROUPS       16      // block groups on a large disk
+#define GROUP_MIN_BLOCKS   BITS_PER_BLOCK  // fewest data blocks in a group
+#define SCAN_MIN_BLOCKS    64      // fewest inode blocks worth a thread of their own
+#define RMAP_PAGES         16      // reverse map blocks kept in memory for each block group
+#define BITS_PER_WORD      64
+#define FULL_WORD          (~(uint64_t) 0)
 
 
 // 0 initialized
 static const char emptyblock[DISK_BLOCK_SIZE];
 
 
-int *bitmap;
+// one bit per block, set when the block is in use. same layout as the on-disk copy
+uint64_t *bitmap;
+int nwords;
 int mounted = 0;
 int ninodes;
+int nblocks;
+
+// inode format of the mounted disk, and the FS_FEATURE_ bits it was formatted with. code that doesn't know a
+// feature sees an unknown inode format and refuses the disk
+int fs_version;
+int fs_features;
+int inodes_per_block;
+
+// inode blocks from itable_init on were never written since format. they are empty, and are neither read nor
+// scanned until an inode in them is saved. while there are such blocks the disk has FS_FEATURE_LAZY_ITABLE, so
+// code that doesn't know the mark never reads them as inodes
+int itable_init;
+
+// allocator state: first data block and number of free blocks
+int data_start;
+int nfree;
+int delay_reserved;     // free blocks held back for delayed writes
+
+// block groups. the inode table and the data region are each split into the same number of slices, and
+// slice k of both makes up group k. a file's blocks come from the group of its inode, next-fit from the group's
+// cursor, so files created together stay together, and threads writing files of different groups rarely wait
+// for each other. a run never crosses a group boundary
+struct fs_group {
+    pthread_mutex_t lock;
+    int start;                  // first block. later groups start on a bitmap word
+    int end;
+    int cursor;
+    int nfree;                  // free blocks in start..end-1
+    int inode_start;            // first inode of the group
+    int inode_end;
+    struct fs_free *index;      // free space index, see free_add
+    int nindex;                 // nodes used or on the unused list
+    int index_capacity;
+    int index_unused;           // first node on the unused list
+    int root[2];
+    unsigned seed;              // for node priorities
+};
+
+// a free run of blocks in the free space index of a group
+struct fs_free {
+    int start;
+    int length;
+    unsigned priority;
+    int child[2][2];            // left and right child in the tree by start and in the tree by length
+    int longest;                // longest run in the subtree of the tree by start
+};
+
+// the lock of a group is taken again by bitmap_set when a block of the group changes under it
+struct fs_group groups[BLOCK_GROUPS] = { [0 ... BLOCK_GROUPS - 1] = { .lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP } };
+int ngroups;
+int create_group;               // group the last inode was created in
+
+// locking. fs_lock is held shared by every file operation, and exclusively by format, mount, unmount, check,
+// sync, defrag, fragstat and debug, which therefore run alone. inside a file operation, in this order:
+//   inode_locks   data, mapping and open file entry of an inode. shared to read, exclusive to change
+//   f->lock       the mapping caches of an open file, which readers holding the inode lock share
+//   table_lock    open file table, inode map, readahead streams and delayed write buffers
+//   group locks   allocation from a block group, and any change to the state of its blocks
+//   itable_lock   read-modify-write of an inode table block
+//   rmap locks    the reverse map pages in memory, one lock per block group
+// a thread holding an inode lock only ever tries for another one, it never waits for it
+pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t inode_locks[INODE_LOCKS] = { [0 ... INODE_LOCKS - 1] = PTHREAD_RWLOCK_INITIALIZER };
+pthread_mutex_t table_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+pthread_mutex_t itable_lock = PTHREAD_MUTEX_INITIALIZER;
+
+pthread_rwlock_t *inode_lock(int inumber) {
+    return &inode_locks[inumber % INODE_LOCKS];
+}
+
+// one bit per inode, set when the inode is valid. NULL until first needed
+uint64_t *inode_map;
+int inode_hint;     // no free inode below this one
+
+// threads scanning the inode table, 0 for one per CPU
+int scan_threads;
+
+// on-disk copy of bitmap, stored right after the inode table
+int nbitmapblocks;
+int bitmap_start;
+char *bitmap_dirty;
+
+// on-disk reverse map, stored right after the bitmap
+int nrmapblocks;
+int rmap_start;
 
 struct fs_superblock {
     int magic;
     int nblocks;
     int ninodeblocks;
     int ninodes;
+    int nbitmapblocks;  // 0 on disks formatted without an on-disk bitmap
+    int clean;          // set on unmount, cleared while mounted
+    int version;        // FS_FORMAT_CLASSIC, FS_FORMAT_EXTENT or FS_FORMAT_INDIRECT, or'ed with FS_FEATURE_ bits
+    int defrag_cursor;  // next inode fs_defrag_step looks at, saved on unmount
+    int nrmapblocks;    // 0 on disks formatted without a reverse map
+    int itable_init;    // first inode block never written, 0 on disks whose whole inode table is written
+};
+
+// a run of length blocks on disk starting at block start
+struct fs_extent {
+    int start;
+    int length;
 };
 
+// inode flags
+#define FS_INODE_EXTENTS 1  // data is mapped by extents instead of block pointers
+#define FS_INODE_INLINE  2  // data is kept in the inode itself, the file has no blocks
+
+// in-memory inode. extent and indirect disks store it as a struct fs_disk_inode
 struct fs_inode {
+    int isvalid;
+    int flags;
+    int64_t size;
+    union {
+        // block mapped. only indirect disks have the double and triple indirect blocks
+        struct {
+            int direct[POINTERS_PER_INODE];
+            int indirect;
+            int dindirect;
+            int tindirect;
+        };
+
+        // extent mapped. extents past INODE_EXTENTS live in the overflow block
+        struct {
+            int nextents;
+            int overflow;
+            struct fs_extent extent[INODE_EXTENTS];
+        };
+
+        // inline. bytes past the size are zero
+        char inline_data[INODE_INLINE];
+    };
+};
+
+// 128-byte on-disk inode of extent and indirect disks. size_high was a reserved 0 before sizes took 64 bits,
+// so disks formatted before keep reading the same. map holds the union of the in-memory inode
+struct fs_disk_inode {
+    int isvalid;
+    int size;           // low 32 bits of the size
+    int flags;
+    int size_high;
+    char map[INODE_INLINE];
+};
+
+// on-disk inode of classic disks
+struct fs_classic_inode {
     int isvalid;
     int size;
     int direct[POINTERS_PER_INODE];
     int indirect;
 };
 
+// which inode a block belongs to and where it comes in the inode's layout: data blocks in file order,
+// each pointer block in front of the blocks it maps. index is -1 for a block a relayout drops.
+// the reverse map on disk holds one for every block, see layout_key
+struct fs_belong {
+    int inode;
+    int index;
+};
+
 union fs_block {
     struct fs_superblock super;
-    struct fs_inode inode[INODES_PER_BLOCK];
+    struct fs_disk_inode inode[INODES_PER_BLOCK];
+    struct fs_classic_inode classic[CLASSIC_INODES_PER_BLOCK];
     int pointers[POINTERS_PER_BLOCK];
+    struct fs_extent extents[EXTENTS_PER_BLOCK];
+    struct fs_belong owners[OWNERS_PER_BLOCK];
     char data[DISK_BLOCK_SIZE];
 };
 
-// check which inode and which component a data block belongs to
-struct fs_belong {
-    int inode;
-    int direct_pointer;
-    int indirect_pointer;
-    int indirect_block;
-};
+_Static_assert(sizeof(struct fs_disk_inode) * INODES_PER_BLOCK == DISK_BLOCK_SIZE, "inode size");
+_Static_assert(sizeof(struct fs_inode) == sizeof(struct fs_disk_inode), "inode map size");
 
+// belong map built by a scan, while defrag or fragstat run without the reverse map
 struct fs_belong *belong;
 
+// pointer block of a double or triple indirect tree, kept by an open file
+struct fs_pointers {
+    int blocknum;               // 0 when nothing is loaded
+    int dirty;
+    union fs_block block;
+};
+
+// open file table. an inode opened more than once shares one entry
+struct fs_file {
+    pthread_mutex_t lock;
+    int inumber;                // 0 when the entry is unused
+    int refs;
+    int64_t position;           // end of the last read or write
+    struct fs_inode inode;
+    int inode_dirty;
+    int64_t disksize;           // size saved with the inode, leaving out data that has no blocks yet
+    union fs_block map;         // copy of the indirect or overflow extent block, valid if map_loaded
+    int map_loaded;
+    int map_dirty;
+    struct fs_pointers pointers[POINTER_LEVELS];   // most recently used pointer block at each level below the inode
+};
+
+struct fs_file open_files[FS_MAX_OPEN] = { [0 ... FS_MAX_OPEN - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER } };
+
+// sequential read state of an inode, kept across opens
+struct fs_stream {
+    int inumber;                // 0 when the entry is unused
+    int next;                   // file block a sequential read starts at
+    int ahead;                  // first file block past what is read ahead
+    int window;                 // blocks kept read ahead, 0 while reads look random
+    unsigned used;              // time of last read, for replacement
+};
+
+struct fs_stream streams[READAHEAD_STREAMS];
+unsigned stream_clock;
+int readahead_limit;            // largest window the block cache allows, 0 disables readahead
+int64_t readahead_fills;
+int64_t readahead_blocks;
+int readahead_base_hits;        // disk readahead hits at mount
+
+// readahead state of inode inumber, taking over the least recently used entry if it has none
+struct fs_stream *stream_get(int inumber) {
+    struct fs_stream *s = &streams[0];
+    for (int i = 0; i < READAHEAD_STREAMS; ++i) {
+        if (streams[i].inumber == inumber) {
+            s = &streams[i];
+            s->used = ++stream_clock;
+            return s;
+        }
+        if (streams[i].used < s->used) s = &streams[i];
+    }
+
+    memset(s, 0, sizeof(struct fs_stream));
+    s->inumber = inumber;
+    s->used = ++stream_clock;
+    return s;
+}
+
+// forget the readahead state of inode inumber, or of every inode if inumber is 0
+void stream_drop(int inumber) {
+    for (int i = 0; i < READAHEAD_STREAMS; ++i) {
+        if (!inumber || streams[i].inumber == inumber) memset(&streams[i], 0, sizeof(struct fs_stream));
+    }
+    return;
+}
+
+// delayed allocation. data written past the blocks a file has on disk waits in a buffer attached to the
+// inode, and its blocks are only allocated when the buffer is flushed, as one run for all of it
+struct fs_delay {
+    int inumber;                // 0 when the entry is unused
+    int start;                  // first file block in the buffer. no block from here on is mapped
+    int nblocks;                // file blocks the buffer covers
+    int capacity;               // blocks data has room for
+    int reserved;               // free blocks held back for the flush
+    int64_t size;               // file size with the buffered data, kept for the next open
+    char *data;
+    unsigned used;              // time of last write, for replacement
+};
+
+struct fs_delay delays[DELAY_FILES];
+unsigned delay_clock;
+int delay_total;                // blocks in all buffers
+
+// delayed write buffer of inode inumber, NULL if it has none
+struct fs_delay *delay_find(int inumber) {
+    for (int i = 0; i < DELAY_FILES; ++i) {
+        if (delays[i].inumber == inumber) return &delays[i];
+    }
+    return NULL;
+}
+
+// incremental defrag. fs_defrag_step moves one file at a time into a free run of its size, a few blocks
+// per step. the run is only taken block by block as data is copied into it
+struct fs_defrag_move {
+    int inumber;                // file being moved, 0 if none
+    int start;                  // free run the file moves to
+    int count;                  // data blocks of the file, the length of the run
+    int done;                   // blocks copied into the run so far
+    int next;                   // first file block not looked at yet
+};
+
+struct fs_defrag_move defrag_move;
+int defrag_cursor;              // next inode to look at
+int defrag_passes;
+int64_t defrag_files;
+int64_t defrag_blocks;
+
+// throw a delayed write buffer away and give back the blocks it held
+void delay_drop(struct fs_delay *d) {
+    __atomic_sub_fetch(&delay_reserved, d->reserved, __ATOMIC_RELAXED);
+    delay_total -= d->nblocks;
+    free(d->data);
+    memset(d, 0, sizeof(struct fs_delay));
+    return;
+}
+
+// number of inode blocks written since format, all of them on older disks
+int itable_blocks(struct fs_superblock *super) {
+    return super->itable_init ? super->itable_init - 1 : super->ninodeblocks;
+}
+
+// get inode j of an inode block in the in-memory format
+void inode_unpack(union fs_block *block, int version, int j, struct fs_inode *inode) {
+    if (version != FS_FORMAT_CLASSIC) {
+        struct fs_disk_inode *disk = &block->inode[j];
+        inode->isvalid = disk->isvalid;
+        inode->flags = disk->flags;
+        inode->size = (int64_t) disk->size_high << 32 | (uint32_t) disk->size;
+        memcpy(inode->inline_data, disk->map, INODE_INLINE);
+        return;
+    }
+
+    struct fs_classic_inode *classic = &block->classic[j];
+    memset(inode, 0, sizeof(struct fs_inode));
+    inode->isvalid = classic->isvalid;
+    inode->size = classic->size;
+    memcpy(inode->direct, classic->direct, sizeof(classic->direct));
+    inode->indirect = classic->indirect;
+    return;
+}
+
+// store an in-memory inode as inode j of an inode block
+void inode_pack(union fs_block *block, int version, int j, struct fs_inode *inode) {
+    if (version != FS_FORMAT_CLASSIC) {
+        struct fs_disk_inode *disk = &block->inode[j];
+        disk->isvalid = inode->isvalid;
+        disk->size = (int) inode->size;
+        disk->flags = inode->flags;
+        disk->size_high = (int) (inode->size >> 32);
+        memcpy(disk->map, inode->inline_data, INODE_INLINE);
+        return;
+    }
+
+    struct fs_classic_inode *classic = &block->classic[j];
+    classic->isvalid = inode->isvalid;
+    classic->size = inode->size;
+    memcpy(classic->direct, inode->direct, sizeof(classic->direct));
+    classic->indirect = inode->indirect;
+    return;
+}
+
+// block blocknum for reading. on a mapped disk this is the block in place, otherwise it is read into buf
+union fs_block *block_get(int blocknum, union fs_block *buf) {
+    union fs_block *block = (union fs_block*) disk_map_block(blocknum, 1);
+    if (block) return block;
+
+    disk_read(blocknum, buf->data);
+    return buf;
+}
+
+// block blocknum for a scan. on a mapped disk this is the block in place, otherwise it is read into buf
+// without going through the block cache, so threads can scan side by side
+union fs_block *block_pread(int blocknum, union fs_block *buf) {
+    union fs_block *block = (union fs_block*) disk_map_block(blocknum, 1);
+    if (block) return block;
+
+    disk_pread(blocknum, buf->data);
+    return buf;
+}
+
+// done reading a block from block_get or block_pread
+void block_put(union fs_block *block, union fs_block *buf) {
+    if (block != buf) disk_unmap_block(1, 0);
+    return;
+}
 
 // load an inode based on inumber, assume valid inumber
 void inode_load(int inumber, struct fs_inode *inode) {
-    int block_number = inumber / INODES_PER_BLOCK + 1;
-    int offset = inumber % INODES_PER_BLOCK;
+    int block_number = inumber / inodes_per_block + 1;
+    int offset = inumber % inodes_per_block;
+
+    // blocks past the written inode table hold nothing yet
+    if (block_number >= __atomic_load_n(&itable_init, __ATOMIC_ACQUIRE)) {
+        memset(inode, 0, sizeof(struct fs_inode));
+        return;
+    }
 
     // read the block with that inode
-    union fs_block block;
-    disk_read(block_number, block.data);
+    union fs_block buf;
+    union fs_block *block = block_get(block_number, &buf);
 
     // get one inode
-    *inode = block.inode[offset];
+    inode_unpack(block, fs_version, offset, inode);
+    block_put(block, &buf);
+    return;
+}
+
+// make inode block blocknum part of the written inode table, zeroing the never written blocks up to it.
+// itable_lock is held. the zeros reach the image before the new mark is written: punched out of it, or
+// written past the block cache, whose write-back may come in any order. so whenever the superblock gets to
+// the image, the mark never covers inodes left from an earlier filesystem. an inode saved past the old mark
+// may get to the image first; a crash then loses it as if it had not been saved
+void itable_extend(int blocknum) {
+    int first = itable_init;
+    if (blocknum < first) return;
+
+    if (!disk_discard(first, blocknum - first + 1)) {
+        for (int b = first; b <= blocknum; ++b) disk_write_blocks(b, 1, emptyblock);
+    }
+
+    union fs_block block;
+    disk_read(0, block.data);
+    block.super.itable_init = blocknum + 1;
+    if (blocknum == block.super.ninodeblocks) block.super.version &= ~FS_FEATURE_LAZY_ITABLE;
+    disk_write(0, block.data);
+    __atomic_store_n(&itable_init, blocknum + 1, __ATOMIC_RELEASE);
     return;
 }
 
 // save an inode based on inumber, assume valid inumber
 void inode_save(int inumber, struct fs_inode *inode) {
-    int block_number = inumber / INODES_PER_BLOCK + 1;
-    int offset = inumber % INODES_PER_BLOCK;
+    int block_number = inumber / inodes_per_block + 1;
+    int offset = inumber % inodes_per_block;
 
-    // read the block with that inode
+    // read the block with that inode. the other inodes in it may be saved by other threads
+    pthread_mutex_lock(&itable_lock);
+    itable_extend(block_number);
     union fs_block block;
     disk_read(block_number, block.data);
 
     // save one inode
-    block.inode[offset] = *inode;
+    inode_pack(&block, fs_version, offset, inode);
 
     // write back
     disk_write(block_number, block.data);
+    pthread_mutex_unlock(&itable_lock);
     return;
 }
 
-// return the block number of a free data block. return 0 at failure
-int get_block() {
-    union fs_block block;
+static inline int bitmap_test(const uint64_t *map, int blocknum) {
+    return (map[blocknum / BITS_PER_WORD] >> (blocknum % BITS_PER_WORD)) & 1;
+}
 
-    // superblock information
-    disk_read(0, block.data);
-    int nblocks = block.super.nblocks;
+static inline void bitmap_mark(uint64_t *map, int blocknum) {
+    map[blocknum / BITS_PER_WORD] |= (uint64_t) 1 << (blocknum % BITS_PER_WORD);
+}
+
+static inline void bitmap_unmark(uint64_t *map, int blocknum) {
+    map[blocknum / BITS_PER_WORD] &= ~((uint64_t) 1 << (blocknum % BITS_PER_WORD));
+}
 
-    for (int i = block.super.ninodeblocks+1; i < nblocks; ++i) {
-        if (bitmap[i]) continue;
+// allocate a packed bitmap for the whole disk, rounded up to whole on-disk bitmap blocks
+uint64_t *bitmap_alloc() {
+    size_t bytes = (size_t) nwords * sizeof(uint64_t);
+    if (bytes < (size_t) nbitmapblocks * DISK_BLOCK_SIZE) bytes = (size_t) nbitmapblocks * DISK_BLOCK_SIZE;
+    return (uint64_t*) calloc(1, bytes);
+}
+
+// bits past the end of the disk are never free
+void bitmap_pad(uint64_t *map) {
+    for (int i = nblocks; i < nwords * BITS_PER_WORD; ++i) bitmap_mark(map, i);
+    return;
+}
+
+// free space index. the free runs of a group are nodes of two treaps at once: one ordered by start, where every
+// node also knows the longest run below it, and one ordered by length. runs near a block, the best fit for a
+// length and the longest run are all found in logarithmic time. node 0 stands for no node
+#define FREE_BY_START  0
+#define FREE_BY_LENGTH 1
+
+// order of runs a and b in tree t
+int free_before(struct fs_group *g, int t, int a, int b) {
+    struct fs_free *x = &g->index[a], *y = &g->index[b];
+    if (t == FREE_BY_LENGTH && x->length != y->length) return x->length < y->length;
+    return x->start < y->start;
+}
+
+void free_update(struct fs_group *g, int t, int a) {
+    if (t != FREE_BY_START) return;
+
+    struct fs_free *x = &g->index[a];
+    int left = g->index[x->child[t][0]].longest, right = g->index[x->child[t][1]].longest;
+    x->longest = x->length;
+    if (left > x->longest) x->longest = left;
+    if (right > x->longest) x->longest = right;
+}
 
-        // not in use
-        bitmap[i] = 1;
-        return i;
+// split tree t under a into the runs before run k and the rest
+void free_split(struct fs_group *g, int t, int a, int k, int *before, int *after) {
+    if (!a) {
+        *before = *after = 0;
+        return;
     }
-    
-    // disk full
-    return 0;
+
+    if (free_before(g, t, a, k)) {
+        free_split(g, t, g->index[a].child[t][1], k, &g->index[a].child[t][1], after);
+        *before = a;
+    } else {
+        free_split(g, t, g->index[a].child[t][0], k, before, &g->index[a].child[t][0]);
+        *after = a;
+    }
+    free_update(g, t, a);
+}
+
+// join trees a and b of tree t, every run of a comes before every run of b
+int free_join(struct fs_group *g, int t, int a, int b) {
+    if (!a || !b) return a ? a : b;
+
+    if (g->index[a].priority > g->index[b].priority) {
+        int right = free_join(g, t, g->index[a].child[t][1], b);
+        g->index[a].child[t][1] = right;
+        free_update(g, t, a);
+        return a;
+    }
+    int left = free_join(g, t, a, g->index[b].child[t][0]);
+    g->index[b].child[t][0] = left;
+    free_update(g, t, b);
+    return b;
+}
+
+int free_insert(struct fs_group *g, int t, int a, int k) {
+    if (!a) return k;
+
+    if (g->index[k].priority > g->index[a].priority) {
+        int before, after;
+        free_split(g, t, a, k, &before, &after);
+        g->index[k].child[t][0] = before;
+        g->index[k].child[t][1] = after;
+        free_update(g, t, k);
+        return k;
+    }
+
+    int side = !free_before(g, t, k, a);
+    int child = free_insert(g, t, g->index[a].child[t][side], k);
+    g->index[a].child[t][side] = child;
+    free_update(g, t, a);
+    return a;
+}
+
+int free_erase(struct fs_group *g, int t, int a, int k) {
+    if (a == k) return free_join(g, t, g->index[k].child[t][0], g->index[k].child[t][1]);
+
+    int side = !free_before(g, t, k, a);
+    int child = free_erase(g, t, g->index[a].child[t][side], k);
+    g->index[a].child[t][side] = child;
+    free_update(g, t, a);
+    return a;
+}
+
+// add the free run start..start+length-1 to the index of group g
+void free_add(struct fs_group *g, int start, int length) {
+    int k = g->index_unused;
+    if (k) {
+        g->index_unused = g->index[k].child[0][0];
+    } else {
+        if (g->nindex == g->index_capacity) {
+            int capacity = g->index_capacity * 2;
+            struct fs_free *index = (struct fs_free*) realloc(g->index, (size_t) capacity * sizeof(struct fs_free));
+            if (!index) {
+                fprintf(stderr, "couldn't grow free space index: %s\n", strerror(errno));
+                abort();
+            }
+            g->index = index;
+            g->index_capacity = capacity;
+        }
+        k = g->nindex++;
+    }
+
+    struct fs_free *x = &g->index[k];
+    memset(x, 0, sizeof(struct fs_free));
+    x->start = start;
+    x->length = length;
+    x->longest = length;
+
+    // xorshift
+    g->seed ^= g->seed << 13;
+    g->seed ^= g->seed >> 17;
+    g->seed ^= g->seed << 5;
+    x->priority = g->seed;
+
+    g->root[FREE_BY_START] = free_insert(g, FREE_BY_START, g->root[FREE_BY_START], k);
+    g->root[FREE_BY_LENGTH] = free_insert(g, FREE_BY_LENGTH, g->root[FREE_BY_LENGTH], k);
+}
+
+void free_remove(struct fs_group *g, int k) {
+    g->root[FREE_BY_START] = free_erase(g, FREE_BY_START, g->root[FREE_BY_START], k);
+    g->root[FREE_BY_LENGTH] = free_erase(g, FREE_BY_LENGTH, g->root[FREE_BY_LENGTH], k);
+    g->index[k].child[0][0] = g->index_unused;
+    g->index_unused = k;
+}
+
+// free run holding block b, or else the last one before it. 0 if there is none
+int free_at(struct fs_group *g, int b) {
+    int found = 0;
+    for (int a = g->root[FREE_BY_START]; a; ) {
+        if (g->index[a].start <= b) {
+            found = a;
+            a = g->index[a].child[FREE_BY_START][1];
+        } else {
+            a = g->index[a].child[FREE_BY_START][0];
+        }
+    }
+    return found;
+}
+
+// first free run under a that starts at or after block b and has at least n blocks, 0 if there is none
+int free_next(struct fs_group *g, int a, int b, int n) {
+    if (!a || g->index[a].longest < n) return 0;
+
+    struct fs_free *x = &g->index[a];
+    if (x->start < b) return free_next(g, x->child[FREE_BY_START][1], b, n);
+
+    int k = free_next(g, x->child[FREE_BY_START][0], b, n);
+    if (k) return k;
+    if (x->length >= n) return a;
+    return free_next(g, x->child[FREE_BY_START][1], b, n);
+}
+
+// shortest free run of at least n blocks, the first of those on disk. 0 if there is none
+int free_best(struct fs_group *g, int n) {
+    int found = 0;
+    for (int a = g->root[FREE_BY_LENGTH]; a; ) {
+        if (g->index[a].length >= n) {
+            found = a;
+            a = g->index[a].child[FREE_BY_LENGTH][0];
+        } else {
+            a = g->index[a].child[FREE_BY_LENGTH][1];
+        }
+    }
+    return found;
+}
+
+// longest free run, the last of those on disk. 0 if the group is full
+int free_longest(struct fs_group *g) {
+    int a = g->root[FREE_BY_LENGTH];
+    while (a && g->index[a].child[FREE_BY_LENGTH][1]) a = g->index[a].child[FREE_BY_LENGTH][1];
+    return a;
+}
+
+// blocks start..start+n-1 of group g turn used or free. used blocks come out of one free run, freed blocks join
+// the runs next to them
+void free_mark(struct fs_group *g, int start, int n, int used) {
+    int a = free_at(g, start);
+    if (used) {
+        struct fs_free x = g->index[a];
+        free_remove(g, a);
+        if (start > x.start) free_add(g, x.start, start - x.start);
+        if (start + n < x.start + x.length) free_add(g, start + n, x.start + x.length - start - n);
+        return;
+    }
+
+    int end = start + n;
+    if (a && g->index[a].start + g->index[a].length == start) {
+        start = g->index[a].start;
+        free_remove(g, a);
+    }
+    int next = free_at(g, end);
+    if (next && g->index[next].start == end) {
+        end += g->index[next].length;
+        free_remove(g, next);
+    }
+    free_add(g, start, end - start);
+}
+
+// group holding block b
+struct fs_group *group_of(int b) {
+    int k = ngroups - 1;
+    while (k > 0 && b < groups[k].start) k--;
+    return &groups[k];
+}
+
+// group of inode inumber
+int inode_group(int inumber) {
+    int k = ngroups - 1;
+    while (k > 0 && inumber < groups[k].inode_start) k--;
+    return k;
+}
+
+// change the state of blocks start..start+n-1, all in one group and all in the other state, in bitmap and in
+// the free space index, and remember which on-disk bitmap blocks to update.
+// other threads change other bits of the same word at the same time
+void bitmap_set_run(int start, int n, int used) {
+    struct fs_group *g = start >= data_start ? group_of(start) : NULL;
+    if (g) pthread_mutex_lock(&g->lock);
+
+    for (int b = start; b < start + n; ++b) {
+        uint64_t bit = (uint64_t) 1 << (b % BITS_PER_WORD);
+        if (used) __atomic_fetch_or(&bitmap[b / BITS_PER_WORD], bit, __ATOMIC_RELAXED);
+        else __atomic_fetch_and(&bitmap[b / BITS_PER_WORD], ~bit, __ATOMIC_RELAXED);
+        if (nbitmapblocks) __atomic_store_n(&bitmap_dirty[b / BITS_PER_BLOCK], 1, __ATOMIC_RELEASE);
+    }
+    __atomic_add_fetch(&nfree, used ? -n : n, __ATOMIC_RELAXED);
+
+    if (g) {
+        __atomic_add_fetch(&g->nfree, used ? -n : n, __ATOMIC_RELAXED);
+        free_mark(g, start, n, used);
+        pthread_mutex_unlock(&g->lock);
+    }
+    return;
+}
+
+// change the state of a block
+void bitmap_set(int blocknum, int used) {
+    if (bitmap_test(bitmap, blocknum) == used) return;
+    bitmap_set_run(blocknum, 1, used);
+    return;
+}
+
+// first clear bit at or after start in a map of nbits bits, nbits if there is none.
+// bits past nbits in the last word must be set
+int bits_next_clear(const uint64_t *map, int nbits, int start) {
+    if (start >= nbits) return nbits;
+
+    int w = start / BITS_PER_WORD;
+    int last = (nbits - 1) / BITS_PER_WORD;
+    uint64_t word = map[w] | ((((uint64_t) 1) << (start % BITS_PER_WORD)) - 1);
+
+    // skip words with every bit set
+    while (word == FULL_WORD) {
+        if (++w > last) return nbits;
+        word = map[w];
+    }
+    return w * BITS_PER_WORD + __builtin_ctzll(~word);
+}
+
+// first free block at or after start, nblocks if there is none
+int next_free(int start) {
+    return bits_next_clear(bitmap, nblocks, start);
+}
+
+// first used block at or after start, nblocks if there is none
+int next_used(int start) {
+    if (start >= nblocks) return nblocks;
+
+    int w = start / BITS_PER_WORD;
+    uint64_t word = bitmap[w] & ~((((uint64_t) 1) << (start % BITS_PER_WORD)) - 1);
+
+    // skip words with every block free
+    while (!word) {
+        if (++w == nwords) return nblocks;
+        word = bitmap[w];
+    }
+
+    int used = w * BITS_PER_WORD + __builtin_ctzll(word);
+    return used < nblocks ? used : nblocks;
+}
+
+// split the inode table and the data region into groups, count the free blocks of each and index its free runs.
+// a small disk is one group
+int groups_init(int inodes) {
+    int span = nblocks - data_start;
+    ngroups = span / GROUP_MIN_BLOCKS;
+    if (ngroups > BLOCK_GROUPS) ngroups = BLOCK_GROUPS;
+    if (ngroups < 1) ngroups = 1;
+
+    for (int k = 0; k < ngroups; ++k) {
+        struct fs_group *g = &groups[k];
+        int64_t end = data_start + (int64_t) span * (k + 1) / ngroups;
+        g->start = k ? groups[k - 1].end : data_start;
+        g->end = k < ngroups - 1 ? end / BITS_PER_WORD * BITS_PER_WORD : nblocks;
+        g->cursor = g->start;
+        g->inode_start = k ? groups[k - 1].inode_end : 1;
+        g->inode_end = k < ngroups - 1 ? (int64_t) inodes * (k + 1) / ngroups : inodes;
+
+        free(g->index);
+        g->index_capacity = 64;
+        g->index = (struct fs_free*) calloc(g->index_capacity, sizeof(struct fs_free));
+        if (!g->index) {
+            fprintf(stderr, "couldn't create free space index: %s\n", strerror(errno));
+            return 0;
+        }
+        g->nindex = 1;
+        g->index_unused = 0;
+        g->root[FREE_BY_START] = g->root[FREE_BY_LENGTH] = 0;
+        g->seed = 2463534242u + k;
+
+        g->nfree = 0;
+        for (int b = bits_next_clear(bitmap, g->end, g->start); b < g->end; ) {
+            int end = next_used(b);
+            if (end > g->end) end = g->end;
+            free_add(g, b, end - b);
+            g->nfree += end - b;
+            b = bits_next_clear(bitmap, g->end, end);
+        }
+    }
+    create_group = 0;
+    return 1;
+}
+
+// start the next-fit search of the group holding block b at b, and of the other groups at their start
+void alloc_reset(int b) {
+    for (int k = 0; k < ngroups; ++k) groups[k].cursor = groups[k].start;
+
+    if (b >= nblocks) b = data_start;
+    group_of(b)->cursor = b;
+    return;
+}
+
+// longest free run of up to n blocks in group s, next-fit from its cursor: the rest of the run holding the
+// cursor, the first long enough run after it, or the first one from the start of the group.
+// the first block is stored in *start, return the length. the group lock is held
+int group_find(struct fs_group *s, int n, int *start) {
+    struct fs_free *index = s->index;
+
+    // no run is long enough, take the longest
+    if (index[s->root[FREE_BY_START]].longest < n) {
+        int a = free_longest(s);
+        *start = index[a].start;
+        return index[a].length;
+    }
+
+    int a = free_at(s, s->cursor);
+    if (a && index[a].start + index[a].length - s->cursor >= n) {
+        *start = s->cursor;
+        return n;
+    }
+
+    a = free_next(s, s->root[FREE_BY_START], s->cursor, n);
+    if (!a) a = free_next(s, s->root[FREE_BY_START], s->start, n);
+    *start = index[a].start;
+    return n;
+}
+
+// mark the run found by group_find used and move the group cursor past it
+void group_take(struct fs_group *s, int start, int n) {
+    bitmap_set_run(start, n, 1);
+
+    s->cursor = start + n;
+    if (s->cursor >= s->end) s->cursor = s->start;
+    return;
+}
+
+// allocate a run of up to n free blocks, next-fit from the cursor of group goal, then of the groups after it.
+// a run of n contiguous blocks is returned when one exists, otherwise the longest run found.
+// the first block is stored in *start, return the length of the run, 0 when the disk is full
+int get_blocks(int goal, int n, int *start) {
+    // blocks held back for delayed writes are not free to anyone else
+    int avail = __atomic_load_n(&nfree, __ATOMIC_RELAXED) - __atomic_load_n(&delay_reserved, __ATOMIC_RELAXED);
+    if (avail <= 0 || n <= 0) return 0;
+    if (n > avail) n = avail;
+
+    int best_group = 0, best_len = 0;
+    for (int k = 0; k < ngroups; ++k) {
+        int i = (goal + k) % ngroups;
+        struct fs_group *s = &groups[i];
+
+        // a group with too few free blocks for the run, or for a longer one than seen so far, is skipped
+        int free = __atomic_load_n(&s->nfree, __ATOMIC_RELAXED);
+        if (free < n && free <= best_len) continue;
+
+        pthread_mutex_lock(&s->lock);
+        int run, len = group_find(s, n, &run);
+        if (len == n) {
+            group_take(s, run, len);
+            pthread_mutex_unlock(&s->lock);
+            *start = run;
+            return len;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        if (len > best_len) {
+            best_group = i;
+            best_len = len;
+        }
+    }
+    if (!best_len) return 0;
+
+    // no group has n blocks in a row, take the longest run seen. it may have shrunk since
+    struct fs_group *s = &groups[best_group];
+    pthread_mutex_lock(&s->lock);
+    int run, len = group_find(s, n, &run);
+    if (len) group_take(s, run, len);
+    pthread_mutex_unlock(&s->lock);
+
+    *start = run;
+    return len;
+}
+
+// return the block number of a free data block, in group goal if it has one. return 0 at failure
+int get_block(int goal) {
+    int blocknum;
+    if (!get_blocks(goal, 1, &blocknum)) return 0;
+    return blocknum;
+}
+
+// shortest free run of at least n blocks on the disk, the first of those. the run is left free.
+// the first block is stored in *start, return its length, 0 if there is none
+int find_best_fit(int n, int *start) {
+    int best_len = 0;
+    for (int k = 0; k < ngroups; ++k) {
+        struct fs_group *g = &groups[k];
+        pthread_mutex_lock(&g->lock);
+        int a = free_best(g, n);
+        if (a && (!best_len || g->index[a].length < best_len)) {
+            best_len = g->index[a].length;
+            *start = g->index[a].start;
+        }
+        pthread_mutex_unlock(&g->lock);
+    }
+    return best_len;
 }
 
-int fs_format() {
+int format_disk(int version) {
+    int discard = version & FS_FORMAT_DISCARD;
+    version &= ~FS_FORMAT_DISCARD;
+
     if (mounted) {
         fprintf(stderr, "file system already mounted\n");
         return 0;
     }
 
+    if (version != FS_FORMAT_CLASSIC && version != FS_FORMAT_EXTENT && version != FS_FORMAT_INDIRECT) {
+        fprintf(stderr, "unknown inode format %d\n", version);
+        return 0;
+    }
+
     union fs_block block;
 
     // superblock information
     disk_read(0, block.data);
 
-    int nblocks = disk_size();
-    int ninodeblocks = (nblocks - 1) / 10 + 1;
+    int size = disk_size();
+    int ninodeblocks = (size - 1) / 10 + 1;
+    int nbitmap = (size - 1) / BITS_PER_BLOCK + 1;
+    int nrmap = (size - 1) / OWNERS_PER_BLOCK + 1;
+
+    if (1 + ninodeblocks + nbitmap + nrmap >= size) {
+        fprintf(stderr, "disk is too small\n");
+        return 0;
+    }
+
+    // the inode table is left as it is and zeroed as inodes are created. a discard punches everything past the
+    // superblock out of the image instead, and the whole table reads as zeroes right away
+    int itable = 1;
+    if (discard) {
+        if (disk_discard(1, size - 1)) itable = ninodeblocks + 1;
+        else fprintf(stderr, "disk image does not support discard\n");
+    }
+
+    // superblock, inode table, bitmap and reverse map are in use, everything else is free. the reverse map
+    // needs no clearing: only the entries of blocks in use are ever read, and allocation writes those
+    int reserved = 1 + ninodeblocks + nbitmap + nrmap;
+    for (int i = 0; i < nbitmap; ++i) {
+        union fs_block bitmap_block;
+        memset(&bitmap_block, 0, sizeof(union fs_block));
 
-    // clear inode table
-    for (int i = 1; i <= ninodeblocks; ++i) disk_write(i, emptyblock);
+        for (int j = 0; j < BITS_PER_BLOCK && i * BITS_PER_BLOCK + j < reserved; ++j) {
+            bitmap_block.data[j / 8] |= 1 << (j % 8);
+        }
+        disk_write(ninodeblocks + 1 + i, bitmap_block.data);
+    }
 
     // set superblock
+    memset(&block, 0, sizeof(union fs_block));
     block.super.magic = FS_MAGIC;
-    block.super.nblocks = nblocks;
+    block.super.nblocks = size;
     block.super.ninodeblocks = ninodeblocks;
-    block.super.ninodes = INODES_PER_BLOCK * ninodeblocks;
+    block.super.ninodes = (version == FS_FORMAT_CLASSIC ? CLASSIC_INODES_PER_BLOCK : INODES_PER_BLOCK) * ninodeblocks;
+    block.super.nbitmapblocks = nbitmap;
+    block.super.nrmapblocks = nrmap;
+    block.super.itable_init = itable;
+    block.super.clean = 1;
+    block.super.version = version;
+    if (version != FS_FORMAT_CLASSIC) block.super.version |= FS_FEATURE_INLINE;
+    if (itable <= ninodeblocks) block.super.version |= FS_FEATURE_LAZY_ITABLE;
 
     // save superblock info
     disk_write(0, block.data);
@@ -134,7 +1019,14 @@ int fs_format() {
     return 1;
 }
 
-void fs_debug() {
+int fs_format(int version) {
+    pthread_rwlock_wrlock(&fs_lock);
+    int ok = format_disk(version);
+    pthread_rwlock_unlock(&fs_lock);
+    return ok;
+}
+
+void debug_disk() {
     union fs_block block;
 
     // superblock information
@@ -143,22 +1035,56 @@ void fs_debug() {
     printf("    %d blocks\n", block.super.nblocks);
     printf("    %d inode blocks\n", block.super.ninodeblocks);
     printf("    %d inodes\n", block.super.ninodes);
-
-    // check each inode block
-    int ninodeblocks = block.super.ninodeblocks;
+    if (block.super.nbitmapblocks) printf("    %d bitmap blocks\n", block.super.nbitmapblocks);
+    if (block.super.nrmapblocks) printf("    %d reverse map blocks\n", block.super.nrmapblocks);
+    if (itable_blocks(&block.super) < block.super.ninodeblocks) printf("    %d inode blocks written\n", itable_blocks(&block.super));
+    int version = block.super.version & FS_VERSION_MASK;
+    if (version == FS_FORMAT_EXTENT) printf("    extent inodes\n");
+    if (version == FS_FORMAT_INDIRECT) printf("    triple indirect inodes\n");
+    if (block.super.version & FS_FEATURE_INLINE) printf("    inline files\n");
+
+    // check each inode block that was written
+    int ninodeblocks = itable_blocks(&block.super);
+    int per_block = block.super.ninodes / block.super.ninodeblocks;
     for (int i = 1; i <= ninodeblocks; ++i) {
-        disk_read(i, block.data);
+        union fs_block *inode_block = block_get(i, &block);
 
         // check each inode in the block
-        for (int j = 0; j < INODES_PER_BLOCK; ++j) {
+        for (int j = 0; j < per_block; ++j) {
+            struct fs_inode curr;
+            inode_unpack(inode_block, version, j, &curr);
+
             // not valid
-            if (!block.inode[j].isvalid) continue;
+            if (!curr.isvalid) continue;
 
-            int inumber = (i-1) * INODES_PER_BLOCK + j;
-            struct fs_inode curr = block.inode[j];
+            int inumber = (i-1) * per_block + j;
 
             printf("inode %d:\n", inumber);
-            printf("    size: %d bytes\n", curr.size);
+            printf("    size: %lld bytes\n", (long long) curr.size);
+
+            if (curr.flags & FS_INODE_INLINE) {
+                printf("    inline data\n");
+                continue;
+            }
+
+            // extent list
+            if (curr.flags & FS_INODE_EXTENTS) {
+                union fs_block extent_block;
+                if (curr.overflow) {
+                    printf("    extent block: %d\n", curr.overflow);
+                    disk_read(curr.overflow, extent_block.data);
+                }
+
+                if (curr.nextents) {
+                    printf("    extents:");
+                    for (int k = 0; k < curr.nextents; ++k) {
+                        struct fs_extent *e = k < INODE_EXTENTS ? &curr.extent[k] : &extent_block.extents[k - INODE_EXTENTS];
+                        printf(" %d-%d", e->start, e->start + e->length - 1);
+                    }
+                    printf("\n");
+                }
+                continue;
+            }
 
             // direct block
             if (memcmp(emptyblock, curr.direct, POINTERS_PER_INODE)) {  // check there are any non-zero pointer. use memcmp to increase robustness
@@ -185,151 +1111,1054 @@ void fs_debug() {
                     printf("\n");
                 }
             }   
+
+            // double and triple indirect trees
+            if (version == FS_FORMAT_INDIRECT && curr.dindirect) printf("    double indirect block: %d\n", curr.dindirect);
+            if (version == FS_FORMAT_INDIRECT && curr.tindirect) printf("    triple indirect block: %d\n", curr.tindirect);
         }
+        block_put(inode_block, &block);
 
     }   
     return;
 }
 
-int fs_mount() {
-    if (mounted) {
-        fprintf(stderr, "file system already mounted\n");
-        return 0;
-    }
+void fs_debug() {
+    pthread_rwlock_wrlock(&fs_lock);
+    debug_disk();
+    pthread_rwlock_unlock(&fs_lock);
+    return;
+}
+
+// allocate an empty inode map. inode 0 and the bits past the last inode are never free
+uint64_t *inode_map_alloc(int n) {
+    int words = (n - 1) / BITS_PER_WORD + 1;
+    uint64_t *map = (uint64_t*) calloc(words, sizeof(uint64_t));
+    if (!map) return NULL;
+
+    bitmap_mark(map, 0);
+    for (int i = n; i < words * BITS_PER_WORD; ++i) bitmap_mark(map, i);
+    return map;
+}
 
+// build inode_map with one pass over the inode table
+int inode_map_build() {
     union fs_block block;
 
     // superblock information
     disk_read(0, block.data);
-    if (FS_MAGIC != block.super.magic) {
-        fprintf(stderr, "disk is not formatted\n");
-        return 0; 
+    int ninodeblocks = itable_blocks(&block.super);
+
+    inode_map = inode_map_alloc(block.super.ninodes);
+    if (!inode_map) {
+        fprintf(stderr, "couldn't create inode map: %s\n", strerror(errno));
+        return 0;
     }
 
-    // check each inode block
-    int ninodeblocks = block.super.ninodeblocks;
-    int nblocks = block.super.nblocks;
+    for (int i = 1; i <= ninodeblocks; ++i) {
+        union fs_block *inode_block = block_get(i, &block);
 
-    if (nblocks != disk_size()) {
-        fprintf(stderr, "disk size error\n");
-        return 0; 
+        for (int j = 0; j < inodes_per_block; ++j) {
+            struct fs_inode curr;
+            inode_unpack(inode_block, fs_version, j, &curr);
+            if (curr.isvalid) bitmap_mark(inode_map, (i-1) * inodes_per_block + j);
+        }
+        block_put(inode_block, &block);
     }
 
-    // declare bitmap
-    bitmap = (int*) calloc(nblocks, sizeof(int));
-    if (!bitmap) {
-        fprintf(stderr, "couldn't create bitmap: %s\n", strerror(errno));
-        return 0;
+    inode_hint = 1;
+    return 1;
+}
+
+// record block b as the next block in the layout of inode inumber, or as dropped if index is NULL
+void belong_set(struct fs_belong *owners, int b, int inumber, int *index) {
+    if (!owners) return;
+    owners[b].inode = inumber;
+    owners[b].index = index ? (*index)++ : -1;
+    return;
+}
+
+// mark the extents and overflow block of an extent mapped inode in map, and record their owner.
+// return 0 on a conflict
+int scan_extents(uint64_t *map, struct fs_inode *inode, struct fs_belong *owners, int inumber) {
+    union fs_block buf;
+    union fs_block *extent_block = NULL;
+    int index = 0;
+
+    // the overflow block is not needed once the file is one extent
+    if (inode->overflow) {
+        if (bitmap_test(map, inode->overflow)) {
+            fprintf(stderr, "illegal fs: data block conflict\n");
+            return 0;
+        }
+        bitmap_mark(map, inode->overflow);
+        belong_set(owners, inode->overflow, inumber, NULL);
+        extent_block = block_pread(inode->overflow, &buf);
     }
 
-    // declare belong map
-    belong = (struct fs_belong*) calloc(nblocks, sizeof(struct fs_belong));
-    if (!belong) {
-        fprintf(stderr, "couldn't create belong map: %s\n", strerror(errno));
+    int ok = 1;
+    for (int k = 0; ok && k < inode->nextents; ++k) {
+        struct fs_extent *e = k < INODE_EXTENTS ? &inode->extent[k] : &extent_block->extents[k - INODE_EXTENTS];
+
+        for (int b = e->start; b < e->start + e->length; ++b) {
+            if (bitmap_test(map, b)) {
+                fprintf(stderr, "illegal fs: data block conflict\n");
+                ok = 0;
+                break;
+            }
+            bitmap_mark(map, b);
+            belong_set(owners, b, inumber, &index);
+        }
+    }
+    if (extent_block) block_put(extent_block, &buf);
+    return ok;
+}
+
+// mark pointer block blocknum and every block below it, levels deep, in map, and record their owner.
+// return 0 on a conflict
+int scan_tree(uint64_t *map, int blocknum, int levels, struct fs_belong *owners, int inumber, int *index) {
+    if (bitmap_test(map, blocknum)) {
+        fprintf(stderr, "illegal fs: data block conflict\n");
         return 0;
     }
+    bitmap_mark(map, blocknum);
+    belong_set(owners, blocknum, inumber, index);
+
+    union fs_block buf;
+    union fs_block *pointer_block = block_pread(blocknum, &buf);
+
+    int ok = 1;
+    for (int k = 0; ok && k < POINTERS_PER_BLOCK; ++k) {
+        int b = pointer_block->pointers[k];
+        if (!b) continue;
+
+        if (levels > 1) {
+            ok = scan_tree(map, b, levels - 1, owners, inumber, index);
+        } else if (bitmap_test(map, b)) {
+            fprintf(stderr, "illegal fs: data block conflict\n");
+            ok = 0;
+        } else {
+            bitmap_mark(map, b);
+            belong_set(owners, b, inumber, index);
+        }
+    }
+    block_put(pointer_block, &buf);
+    return ok;
+}
 
-    // superblock as 1
-    *(bitmap) = 1;
+// a range of inode blocks scanned by one thread. blocks are marked in the thread's own bitmap, merged when
+// every thread is done. owners and the inode map are shared: threads set different entries of them
+struct fs_scan {
+    int first;              // inode blocks first..last-1
+    int last;
+    uint64_t *map;
+    struct fs_belong *owners;
+    uint64_t *imap;
+    int ok;
+    pthread_t thread;
+};
 
-    for (int i = 1; i <= ninodeblocks; ++i) {
-        union fs_block inode_block;
-        disk_read(i, inode_block.data);
+// mark the blocks of every valid inode in a range of inode blocks. reads are positional or in place, so ranges
+// can be scanned at the same time. scan->ok is 0 on a conflict inside the range
+void *scan_range(void *arg) {
+    struct fs_scan *scan = (struct fs_scan*) arg;
+    scan->ok = 0;
 
-        // this inode block is in use
-        *(bitmap + i) = 1;
+    for (int i = scan->first; i < scan->last; ++i) {
+        union fs_block buf;
+        union fs_block *inode_block = block_pread(i, &buf);
 
         // check each inode
-        for (int j = 0; j < INODES_PER_BLOCK; ++j) {
-            if (!inode_block.inode[j].isvalid) continue;
+        for (int j = 0; j < inodes_per_block; ++j) {
+            struct fs_inode inode;
+            inode_unpack(inode_block, fs_version, j, &inode);
+            if (!inode.isvalid) continue;
+
+            struct fs_inode *curr = &inode;
+            int inode_number = (i-1) * inodes_per_block + j;
+            if (scan->imap) bitmap_mark(scan->imap, inode_number);
+            if (curr->flags & FS_INODE_INLINE) continue;
+
+            // extent mapped
+            if (curr->flags & FS_INODE_EXTENTS) {
+                if (!scan_extents(scan->map, curr, scan->owners, inode_number)) {
+                    block_put(inode_block, &buf);
+                    return NULL;
+                }
+                continue;
+            }
 
-            // check each direct pointer
-            struct fs_inode *curr = &inode_block.inode[j];
-            int inode_number = (i-1) * INODES_PER_BLOCK + j;
+            // position of the next block in the inode's layout
+            int index = 0;
 
+            // check each direct pointer
             for (int k = 0; k < POINTERS_PER_INODE; ++k) {
                 if (curr->direct[k]) {
 
                     // change bit map
-                    int *bit = bitmap + curr->direct[k];
-                    if (*bit) { // multiple inode to the same data block
+                    if (bitmap_test(scan->map, curr->direct[k])) { // multiple inode to the same data block
                         fprintf(stderr, "illegal fs: data block conflict\n");
-                        return 0;
+                        block_put(inode_block, &buf);
+                        return NULL;
                     }
 
-                    *(bit) = 1;
+                    bitmap_mark(scan->map, curr->direct[k]);
 
                     // change belong map
-                    memset(&belong[curr->direct[k]], 0, sizeof(struct fs_belong));
-                    belong[curr->direct[k]].inode = inode_number;
-                    belong[curr->direct[k]].direct_pointer = k+1;
+                    belong_set(scan->owners, curr->direct[k], inode_number, &index);
                 }
             }
 
             // check indirect pointer
             if (curr->indirect) {
                 // this pointer block is in use
-                *(bitmap + curr->indirect) = 1;
+                bitmap_mark(scan->map, curr->indirect);
 
                 // change belong map
-                memset(&belong[curr->indirect], 0, sizeof(struct fs_belong));
-                belong[curr->indirect].inode = inode_number;
-                belong[curr->indirect].indirect_pointer = 1;
+                belong_set(scan->owners, curr->indirect, inode_number, &index);
 
-                union fs_block pointer_block;
-                disk_read(curr->indirect, pointer_block.data);
+                union fs_block pointer_buf;
+                union fs_block *pointer_block = block_pread(curr->indirect, &pointer_buf);
 
                 // check each pointer
                 for (int k = 0; k < POINTERS_PER_BLOCK; ++k) {
-                    if (pointer_block.pointers[k]) {
+                    if (pointer_block->pointers[k]) {
                         // change bitmap
-                        *(bitmap + pointer_block.pointers[k]) = 1;
+                        bitmap_mark(scan->map, pointer_block->pointers[k]);
 
                         // change belong map
-                        memset(&belong[pointer_block.pointers[k]], 0, sizeof(struct fs_belong));
-                        belong[pointer_block.pointers[k]].inode = inode_number;
-                        belong[pointer_block.pointers[k]].indirect_block = k+1;
+                        belong_set(scan->owners, pointer_block->pointers[k], inode_number, &index);
                     }
                 }
+                block_put(pointer_block, &pointer_buf);
+            }
+
+            // double and triple indirect trees
+            if ((curr->dindirect && !scan_tree(scan->map, curr->dindirect, 2, scan->owners, inode_number, &index)) ||
+                (curr->tindirect && !scan_tree(scan->map, curr->tindirect, 3, scan->owners, inode_number, &index))) {
+                block_put(inode_block, &buf);
+                return NULL;
+            }
+        }
+        block_put(inode_block, &buf);
+    }
+
+
+    scan->ok = 1;
+    return NULL;
+}
+
+// mark every block reachable from the inode table in map, and record owners in belong if given.
+// valid inodes are marked in imap if given. the inode table is split between up to scan_threads threads.
+// return 0 if two inodes claim the same data block
+int scan_blocks(uint64_t *map, struct fs_belong *owners, uint64_t *imap) {
+    union fs_block block;
+
+    // superblock information
+    disk_read(0, block.data);
+
+    // superblock, inode table, bitmap and reverse map blocks are always in use
+    for (int i = 0; i <= block.super.ninodeblocks + block.super.nbitmapblocks + block.super.nrmapblocks; ++i) bitmap_mark(map, i);
+    bitmap_pad(map);
+
+    // only the written part of the inode table can have valid inodes
+    int ninodeblocks = itable_blocks(&block.super);
+    if (!ninodeblocks) return 1;
+
+    // ranges hold whole words of the inode map, so no two threads write the same word
+    int step = inodes_per_block < BITS_PER_WORD ? BITS_PER_WORD / inodes_per_block : 1;
+    int nthreads = scan_threads > 0 ? scan_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > SCAN_THREADS_MAX) nthreads = SCAN_THREADS_MAX;
+    if (nthreads > ninodeblocks / SCAN_MIN_BLOCKS) nthreads = ninodeblocks / SCAN_MIN_BLOCKS;
+    if (nthreads < 1) nthreads = 1;
+    int chunk = ((ninodeblocks + nthreads - 1) / nthreads + step - 1) / step * step;
+
+    struct fs_scan scans[SCAN_THREADS_MAX];
+    int nscans = 0;
+    for (int first = 1; first <= ninodeblocks; first += chunk) {
+        struct fs_scan *scan = &scans[nscans];
+        scan->first = first;
+        scan->last = first + chunk <= ninodeblocks ? first + chunk : ninodeblocks + 1;
+        scan->owners = owners;
+        scan->imap = imap;
+
+        // the first range goes straight into map, the others into bitmaps of their own
+        scan->map = nscans ? bitmap_alloc() : map;
+        if (!scan->map) {
+            fprintf(stderr, "couldn't create bitmap: %s\n", strerror(errno));
+            break;
+        }
+        if (nscans && pthread_create(&scan->thread, NULL, scan_range, scan)) scan->thread = 0;
+        nscans++;
+    }
+
+    // this thread takes the first range and any range a thread could not be started for
+    for (int k = 0; k < nscans; ++k) {
+        if (!k || !scans[k].thread) scan_range(&scans[k]);
+    }
+    for (int k = 1; k < nscans; ++k) {
+        if (scans[k].thread) pthread_join(scans[k].thread, NULL);
+    }
+
+    // a range without a bitmap was never scanned
+    int ok = nscans && scans[nscans - 1].last > ninodeblocks;
+
+    // merge. a block marked by two ranges is claimed twice
+    for (int k = 0; k < nscans; ++k) {
+        if (!scans[k].ok) ok = 0;
+        if (!k) continue;
+
+        for (int w = 0; w < nwords; ++w) {
+            if (map[w] & scans[k].map[w]) {
+                if (ok) fprintf(stderr, "illegal fs: data block conflict\n");
+                ok = 0;
+            }
+            map[w] |= scans[k].map[w];
+        }
+        free(scans[k].map);
+    }
+    return ok;
+}
+
+// threads used by later scans of the inode table at mount, fs_check, defrag and fragstat. 0 for one per CPU
+void fs_scan_threads(int n) {
+    scan_threads = n < 0 ? 0 : n;
+    return;
+}
+
+// load the on-disk free block bitmap into bitmap
+void bitmap_load() {
+    for (int i = 0; i < nbitmapblocks; ++i) {
+        disk_read(bitmap_start + i, (char*) bitmap + (size_t) i * DISK_BLOCK_SIZE);
+    }
+    bitmap_pad(bitmap);
+    return;
+}
+
+// write back the on-disk bitmap blocks changed since the last sync
+void bitmap_sync() {
+    for (int i = 0; i < nbitmapblocks; ++i) {
+        // cleared first: a bit set while the block is written marks it dirty again
+        if (!__atomic_exchange_n(&bitmap_dirty[i], 0, __ATOMIC_ACQ_REL)) continue;
+
+        disk_write(bitmap_start + i, (char*) bitmap + (size_t) i * DISK_BLOCK_SIZE);
+    }
+    return;
+}
+
+// record the clean/dirty state and the incremental defrag cursor in the superblock
+void set_clean(int clean) {
+    union fs_block block;
+    disk_read(0, block.data);
+    block.super.clean = clean;
+    block.super.defrag_cursor = defrag_cursor;
+    disk_write(0, block.data);
+    return;
+}
+
+// place of logical block p of a block mapped file in the file's layout, or of the pointer block up levels
+// above it: every pointer block comes in front of the blocks it maps, as if the file had no holes
+int layout_key(int p, int up) {
+    if (p < POINTERS_PER_INODE) return p;
+    p -= POINTERS_PER_INODE;
+
+    if (p < POINTERS_PER_BLOCK) return up ? POINTERS_PER_INODE : POINTERS_PER_INODE + 1 + p;
+    p -= POINTERS_PER_BLOCK;
+
+    // double or triple indirect tree. size is the number of blocks in the layout of the tree at the current level,
+    // span the number of data blocks under one pointer of it
+    int key = MAX_FILE_BLOCKS + 1;
+    int levels = 2;
+    int size = 1 + POINTERS_PER_BLOCK * (1 + POINTERS_PER_BLOCK);
+    int span = POINTERS_PER_BLOCK;
+    if (p >= DIND_BLOCKS) {
+        p -= DIND_BLOCKS;
+        key += size;
+        levels = 3;
+        size = 1 + POINTERS_PER_BLOCK * size;
+        span = DIND_BLOCKS;
+    }
+
+    while (levels > up) {
+        int child = (size - 1) / POINTERS_PER_BLOCK;
+        key += 1 + p / span * child;
+        p %= span;
+        size = child;
+        span /= POINTERS_PER_BLOCK;
+        levels--;
+    }
+    return key;
+}
+
+// a reverse map block in memory. blocknum is 0 for a page that holds nothing
+struct fs_rmap_page {
+    int blocknum;
+    int dirty;
+    uint64_t used;              // clock of its cache when last used
+    union fs_block block;
+};
+
+// reverse map pages of one block group. a reverse map block is kept by the group its first entry falls in,
+// so threads allocating in different groups page the map in and out without waiting for each other
+struct fs_rmap_cache {
+    pthread_mutex_t lock;
+    uint64_t clock;
+    struct fs_rmap_page pages[RMAP_PAGES];
+};
+
+struct fs_rmap_cache rmap_caches[BLOCK_GROUPS] = { [0 ... BLOCK_GROUPS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER } };
+
+// cache keeping the reverse map block with the entry of block b
+struct fs_rmap_cache *rmap_cache_of(int b) {
+    return &rmap_caches[group_of(b / OWNERS_PER_BLOCK * OWNERS_PER_BLOCK) - groups];
+}
+
+// whether every block of the reverse map page holding b is free, other than blocks b..b+n-1
+int rmap_page_free(int b, int n) {
+    int first = b / OWNERS_PER_BLOCK * OWNERS_PER_BLOCK;
+    int end = first + OWNERS_PER_BLOCK < nblocks ? first + OWNERS_PER_BLOCK : nblocks;
+    for (int u = next_used(first); u < end; u = next_used(u + 1)) {
+        if (u < b || u >= b + n) return 0;
+    }
+    return 1;
+}
+
+// entry of block b in the reverse map, paged in over the page of c used longest ago. the caller overwrites
+// the entries of blocks b..b+n-1, or only reads if n is 0. the lock of c is held
+struct fs_belong *rmap_entry(struct fs_rmap_cache *c, int b, int n) {
+    int blocknum = rmap_start + b / OWNERS_PER_BLOCK;
+    struct fs_rmap_page *page = NULL, *victim = &c->pages[0];
+    for (int k = 0; k < RMAP_PAGES && !page; ++k) {
+        if (c->pages[k].blocknum == blocknum) page = &c->pages[k];
+        else if (c->pages[k].used < victim->used) victim = &c->pages[k];
+    }
+
+    // entries of free blocks are never read, so a page with no other block in use starts out empty
+    if (!page) {
+        page = victim;
+        if (page->dirty) disk_write(page->blocknum, page->block.data);
+        if (n && rmap_page_free(b, n)) memset(page->block.data, 0, DISK_BLOCK_SIZE);
+        else disk_read(blocknum, page->block.data);
+        page->blocknum = blocknum;
+        page->dirty = 0;
+    }
+
+    page->used = ++c->clock;
+    page->dirty |= n > 0;
+    return &page->block.owners[b % OWNERS_PER_BLOCK];
+}
+
+// record blocks start..start+n-1 as blocks index, index+1, ... of inode inumber, or as dropped if index is -1.
+// entries of free blocks are left as they are: the bitmap tells which entries count
+void rmap_set_run(int start, int n, int inumber, int index) {
+    if (!nrmapblocks) return;
+
+    for (int b = start; b < start + n; ) {
+        // the rest of the run on this page
+        struct fs_rmap_cache *c = rmap_cache_of(b);
+        int k = OWNERS_PER_BLOCK - b % OWNERS_PER_BLOCK;
+        if (k > start + n - b) k = start + n - b;
+        pthread_mutex_lock(&c->lock);
+        struct fs_belong *e = rmap_entry(c, b, k);
+
+        for (int j = 0; j < k; ++j) {
+            e[j].inode = inumber;
+            e[j].index = index < 0 ? -1 : index + b - start + j;
+        }
+        pthread_mutex_unlock(&c->lock);
+        b += k;
+    }
+    return;
+}
+
+void rmap_set(int blocknum, int inumber, int index) {
+    rmap_set_run(blocknum, 1, inumber, index);
+    return;
+}
+
+// owner of block b by the reverse map
+struct fs_belong rmap_get(int b) {
+    struct fs_rmap_cache *c = rmap_cache_of(b);
+    pthread_mutex_lock(&c->lock);
+    struct fs_belong owner = *rmap_entry(c, b, 0);
+    pthread_mutex_unlock(&c->lock);
+    return owner;
+}
+
+// owner of block b, from the belong map while a scan built one
+struct fs_belong owner_of(int b) {
+    return belong ? belong[b] : rmap_get(b);
+}
+
+// write back the reverse map pages changed since the last sync, and forget all pages if drop is set.
+// like the bitmap, the pages go to disk on every file_sync and fs_sync, not as each entry changes
+void rmap_sync(int drop) {
+    for (int g = 0; g < BLOCK_GROUPS; ++g) {
+        struct fs_rmap_cache *c = &rmap_caches[g];
+        pthread_mutex_lock(&c->lock);
+        for (int k = 0; k < RMAP_PAGES; ++k) {
+            struct fs_rmap_page *page = &c->pages[k];
+            if (page->dirty) disk_write(page->blocknum, page->block.data);
+            page->dirty = 0;
+            if (drop) page->blocknum = 0;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    return;
+}
+
+// record pointer block blocknum, levels deep, and every block below it in the reverse map. p is the first
+// logical block the tree maps
+void rmap_tree(int blocknum, int levels, int inumber, int p) {
+    rmap_set(blocknum, inumber, layout_key(p, levels));
+
+    union fs_block pointer_block;
+    disk_read(blocknum, pointer_block.data);
+
+    int span = levels > 2 ? DIND_BLOCKS : levels > 1 ? POINTERS_PER_BLOCK : 1;
+    for (int k = 0; k < POINTERS_PER_BLOCK; ++k) {
+        int b = pointer_block.pointers[k];
+        if (!b) continue;
+
+        if (levels > 1) rmap_tree(b, levels - 1, inumber, p + k * span);
+        else rmap_set(b, inumber, layout_key(p + k, 0));
+    }
+    return;
+}
+
+// write the reverse map entry of every block in use from the inode table, after a crash lost changes to it
+// or a defrag moved everything
+void rmap_rebuild() {
+    if (!nrmapblocks) return;
+
+    // each inode block is read once
+    union fs_block inode_block;
+    for (int i = 1; i < (itable_init - 1) * inodes_per_block; ++i) {
+        if (i == 1 || i % inodes_per_block == 0) disk_read(i / inodes_per_block + 1, inode_block.data);
+
+        struct fs_inode inode;
+        inode_unpack(&inode_block, fs_version, i % inodes_per_block, &inode);
+        if (!inode.isvalid || (inode.flags & FS_INODE_INLINE)) continue;
+
+        // extent files map their blocks in file order, the overflow block is not part of the layout
+        if (inode.flags & FS_INODE_EXTENTS) {
+            union fs_block extent_block;
+            if (inode.overflow) {
+                rmap_set(inode.overflow, i, -1);
+                disk_read(inode.overflow, extent_block.data);
+            }
+
+            int p = 0;
+            for (int k = 0; k < inode.nextents; ++k) {
+                struct fs_extent *e = k < INODE_EXTENTS ? &inode.extent[k] : &extent_block.extents[k - INODE_EXTENTS];
+                rmap_set_run(e->start, e->length, i, p);
+                p += e->length;
             }
+            continue;
+        }
+
+        for (int k = 0; k < POINTERS_PER_INODE; ++k) {
+            if (inode.direct[k]) rmap_set(inode.direct[k], i, k);
+        }
+        if (inode.indirect) rmap_tree(inode.indirect, 1, i, POINTERS_PER_INODE);
+        if (inode.dindirect) rmap_tree(inode.dindirect, 2, i, MAX_FILE_BLOCKS);
+        if (inode.tindirect) rmap_tree(inode.tindirect, 3, i, MAX_FILE_BLOCKS + DIND_BLOCKS);
+    }
+    rmap_sync(0);
+    return;
+}
+
+// open entry of an inode, NULL if it is not open
+struct fs_file *file_find(int inumber) {
+    for (int i = 0; i < FS_MAX_OPEN; ++i) {
+        if (open_files[i].inumber == inumber) return &open_files[i];
+    }
+    return NULL;
+}
+
+// entry of a file descriptor, NULL with a message if it is not open
+struct fs_file *file_get(int fd) {
+    if (fd < 0 || fd >= FS_MAX_OPEN || !open_files[fd].inumber) {
+        fprintf(stderr, "illegal file descriptor\n");
+        return NULL;
+    }
+    return &open_files[fd];
+}
+
+// write back the metadata an open file has changed
+void file_sync(struct fs_file *f) {
+    if (f->map_dirty) {
+        disk_write(f->inode.flags & FS_INODE_EXTENTS ? f->inode.overflow : f->inode.indirect, f->map.data);
+        f->map_dirty = 0;
+    }
+
+    for (int d = 0; d < POINTER_LEVELS; ++d) {
+        if (!f->pointers[d].dirty) continue;
+        disk_write(f->pointers[d].blocknum, f->pointers[d].block.data);
+        f->pointers[d].dirty = 0;
+    }
+
+    // data in a delayed write buffer has no blocks on disk, so the size saved leaves it out
+    if (f->inode_dirty) {
+        struct fs_inode inode = f->inode;
+        inode.size = f->disksize;
+        inode_save(f->inumber, &inode);
+        f->inode_dirty = 0;
+    }
+
+    bitmap_sync();
+    rmap_sync(0);
+}
+
+// free the in-memory state of a mount: bitmap, inode map and free space indexes. unmount and a failed
+// mount both end here
+void mount_free() {
+    free(bitmap);
+    free(bitmap_dirty);
+    free(inode_map);
+    bitmap = NULL;
+    bitmap_dirty = NULL;
+    inode_map = NULL;
+    for (int k = 0; k < BLOCK_GROUPS; ++k) {
+        free(groups[k].index);
+        groups[k].index = NULL;
+    }
+    return;
+}
+
+int mount_disk(int cache_blocks) {
+    if (mounted) {
+        fprintf(stderr, "file system already mounted\n");
+        return 0;
+    }
+
+    union fs_block block;
+
+    // superblock information
+    disk_read(0, block.data);
+    if (FS_MAGIC != (unsigned) block.super.magic) {
+        fprintf(stderr, "disk is not formatted\n");
+        return 0; 
+    }
+
+    nblocks = block.super.nblocks;
+
+    if (nblocks != disk_size()) {
+        fprintf(stderr, "disk size error\n");
+        return 0; 
+    }
+
+    // inode format
+    fs_version = block.super.version & FS_VERSION_MASK;
+    fs_features = block.super.version & ~FS_VERSION_MASK;
+    if (fs_version != FS_FORMAT_CLASSIC && fs_version != FS_FORMAT_EXTENT && fs_version != FS_FORMAT_INDIRECT) {
+        fprintf(stderr, "unknown inode format %d\n", fs_version);
+        return 0;
+    }
+    if (fs_features & ~FS_FEATURES) {
+        fprintf(stderr, "unknown disk features %#x\n", fs_features & ~FS_FEATURES);
+        return 0;
+    }
+    inodes_per_block = fs_version == FS_FORMAT_CLASSIC ? CLASSIC_INODES_PER_BLOCK : INODES_PER_BLOCK;
+
+    // cache disk geometry
+    nwords = (nblocks - 1) / BITS_PER_WORD + 1;
+    nbitmapblocks = block.super.nbitmapblocks;
+    bitmap_start = block.super.ninodeblocks + 1;
+    nrmapblocks = block.super.nrmapblocks;
+    rmap_start = bitmap_start + nbitmapblocks;
+    itable_init = itable_blocks(&block.super) + 1;
+    data_start = rmap_start + nrmapblocks;
+
+    // declare bitmap
+    bitmap = bitmap_alloc();
+    if (!bitmap) {
+        fprintf(stderr, "couldn't create bitmap: %s\n", strerror(errno));
+        return 0;
+    }
+
+    // one dirty flag per on-disk bitmap block
+    bitmap_dirty = (char*) calloc(nbitmapblocks + 1, sizeof(char));
+    if (!bitmap_dirty) {
+        fprintf(stderr, "couldn't create bitmap: %s\n", strerror(errno));
+        mount_free();
+        return 0;
+    }
+
+    if (nbitmapblocks && block.super.clean) {
+        // clean shutdown, trust the on-disk bitmap
+        bitmap_load();
+    } else {
+        // old format or unclean shutdown: rebuild from the inode table
+        if (nbitmapblocks) fprintf(stderr, "file system was not cleanly unmounted, rebuilding bitmap\n");
+
+        // the inode table is read anyway, keep the inode map too
+        inode_map = inode_map_alloc(block.super.ninodes);
+        if (!inode_map || !scan_blocks(bitmap, NULL, inode_map)) {
+            mount_free();
+            return 0;
         }
+        inode_hint = 1;
+
+        memset(bitmap_dirty, 1, nbitmapblocks);
+        bitmap_sync();
+    }
+
+    // count free blocks
+    nfree = 0;
+    for (int i = 0; i < nwords; ++i) nfree += BITS_PER_WORD - __builtin_popcountll(bitmap[i]);
+    if (!groups_init(block.super.ninodes)) {
+        mount_free();
+        return 0;
+    }
+
+    // mark the disk in use until unmount
+    if (nbitmapblocks) set_clean(0);
+
+    // set up the block cache for this mount
+    if (!disk_cache_init(cache_blocks)) {
+        fprintf(stderr, "couldn't create block cache: %s\n", strerror(errno));
+        mount_free();
+        return 0;
     }
 
+    // incremental defrag carries on where it stopped
+    defrag_cursor = block.super.defrag_cursor;
+    if (defrag_cursor < 1 || defrag_cursor >= block.super.ninodes) defrag_cursor = 1;
+    memset(&defrag_move, 0, sizeof(struct fs_defrag_move));
+    defrag_passes = 0;
+    defrag_files = 0;
+    defrag_blocks = 0;
+
+    // readahead may fill up to half the cache at once: the window plus the read it runs ahead of
+    struct disk_stats stats;
+    disk_get_stats(&stats);
+    stream_drop(0);
+    for (int i = 0; i < DELAY_FILES; ++i) delay_drop(&delays[i]);
+    delay_reserved = 0;
+    delay_total = 0;
+    readahead_limit = disk_cache_size() / 4 < READAHEAD_MAX ? disk_cache_size() / 4 : READAHEAD_MAX;
+    readahead_fills = 0;
+    readahead_blocks = 0;
+    readahead_base_hits = stats.prefetch_hits;
+
     // change related global state
     mounted = 1;
     ninodes = block.super.ninodes;
+
+    // changes to the reverse map since the last sync may be lost as well
+    if (nrmapblocks && !block.super.clean) rmap_rebuild();
     return 1;
 }
 
-int fs_create() {
+int fs_mount(int cache_blocks) {
+    pthread_rwlock_wrlock(&fs_lock);
+    int ok = mount_disk(cache_blocks);
+    pthread_rwlock_unlock(&fs_lock);
+    return ok;
+}
+
+// delayed writes are flushed on unmount
+int sync_delays();
+
+int unmount_disk() {
     if (!mounted) {
         fprintf(stderr, "file system not mounted yet\n");
         return 0;
     }
 
-    // check inode
-    for (int i = 1; i < ninodes; ++i) {
-        // load inode
-        struct fs_inode curr;
-        inode_load(i, &curr);
+    // close every open file
+    for (int i = 0; i < FS_MAX_OPEN; ++i) {
+        if (!open_files[i].inumber) continue;
+        file_sync(&open_files[i]);
+        open_files[i].inumber = 0;
+    }
 
-        // valid, already there
-        if (curr.isvalid) continue;
+    // delayed writes get their blocks now
+    sync_delays();
 
-        // initialize
-        memset(&curr, 0, sizeof(struct fs_inode));
-        curr.isvalid = 1;
+    // bitmap and reverse map on disk are now up to date
+    bitmap_sync();
+    rmap_sync(1);
+    if (nbitmapblocks) set_clean(1);
 
-        // save back
-        inode_save(i, &curr);
-        return i;
+    // write back every dirty block and drop the cache
+    disk_flush();
+    disk_cache_init(0);
+    stream_drop(0);
+    readahead_limit = 0;
+
+    mount_free();
+    mounted = 0;
+    return 1;
+}
+
+int fs_unmount() {
+    pthread_rwlock_wrlock(&fs_lock);
+    int ok = unmount_disk();
+    pthread_rwlock_unlock(&fs_lock);
+    return ok;
+}
+
+// mark an unmounted disk as not cleanly unmounted, as a crash leaves it, so the next mount scans the inode
+// table. bench scan uses it to time that scan
+int fs_mark_unclean() {
+    pthread_rwlock_wrlock(&fs_lock);
+    union fs_block block;
+    int ok = !mounted;
+    if (!ok) fprintf(stderr, "file system is mounted\n");
+    else {
+        disk_read(0, block.data);
+        ok = (unsigned) block.super.magic == FS_MAGIC;
+        if (!ok) fprintf(stderr, "disk is not formatted\n");
     }
+    if (ok) {
+        block.super.clean = 0;
+        disk_write(0, block.data);
+        disk_flush();
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    return ok;
+}
 
-    fprintf(stderr, "cannot create new inode: inode table is full\n");
-    return 0;
+// rescan the inode table and repair the bitmap if it disagrees
+int check_disk() {
+    if (!mounted) {
+        fprintf(stderr, "file system not mounted yet\n");
+        return -1;
+    }
+
+    uint64_t *scanned = bitmap_alloc();
+    if (!scanned) {
+        fprintf(stderr, "couldn't create bitmap: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (!scan_blocks(scanned, NULL, NULL)) {
+        free(scanned);
+        return -1;
+    }
+
+    int mismatch = 0;
+    for (int w = 0; w < nwords; ++w) {
+        if (bitmap[w] == scanned[w]) continue;
+
+        // only visit the blocks that differ
+        uint64_t diff = bitmap[w] ^ scanned[w];
+        mismatch += __builtin_popcountll(diff);
+        while (diff) {
+            int i = w * BITS_PER_WORD + __builtin_ctzll(diff);
+            bitmap_set(i, bitmap_test(scanned, i));
+            diff &= diff - 1;
+        }
+    }
+    bitmap_sync();
+
+    // blocks the bitmap lost track of have no reverse map entries either
+    if (mismatch) rmap_rebuild();
+
+    free(scanned);
+    return mismatch;
 }
 
-int fs_delete(int inumber) {
+int fs_check() {
+    pthread_rwlock_wrlock(&fs_lock);
+    int mismatch = check_disk();
+    pthread_rwlock_unlock(&fs_lock);
+    return mismatch;
+}
+
+// lowest free inode of group k, ninodes if it has none
+int group_free_inode(int k) {
+    struct fs_group *g = &groups[k];
+    int i = bits_next_clear(inode_map, g->inode_end, g->inode_start > inode_hint ? g->inode_start : inode_hint);
+    return i < g->inode_end ? i : ninodes;
+}
+
+int inode_create() {
+    if (!mounted) {
+        fprintf(stderr, "file system not mounted yet\n");
+        return 0;
+    }
+
+    if (!inode_map && !inode_map_build()) return 0;
+
+    // new inodes go to the group of the last one while it has a free inode and its share of free blocks is no
+    // more than 1/16 below that of the disk as a whole. otherwise the group with the most free blocks that has a
+    // free inode takes over
+    struct fs_group *g = &groups[create_group];
+    int64_t span = nblocks - data_start, size = g->end - g->start;
+    int i = group_free_inode(create_group);
+    if (i >= ninodes || 16 * g->nfree * span < 16 * nfree * size - size * span) {
+        int best = -1;
+        for (int k = 0; k < ngroups; ++k) {
+            int j = group_free_inode(k);
+            if (j >= ninodes || (best >= 0 && groups[k].nfree <= groups[best].nfree)) continue;
+            best = k;
+            i = j;
+        }
+        if (best < 0) {
+            fprintf(stderr, "cannot create new inode: inode table is full\n");
+            return 0;
+        }
+        create_group = best;
+    }
+
+    // initialize
+    struct fs_inode curr;
+    memset(&curr, 0, sizeof(struct fs_inode));
+    curr.isvalid = 1;
+    if (fs_version == FS_FORMAT_EXTENT) curr.flags = FS_INODE_EXTENTS;
+
+    // on disks with inline files a file starts out inline and gets blocks once it outgrows the inode.
+    // 128-byte inodes of disks formatted before keep their map, which older code can still read
+    if (fs_features & FS_FEATURE_INLINE) curr.flags |= FS_INODE_INLINE;
+
+    // save back
+    inode_save(i, &curr);
+    bitmap_mark(inode_map, i);
+    if (i == inode_hint) inode_hint = i + 1;
+    return i;
+}
+
+int fs_create() {
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_mutex_lock(&table_lock);
+    int inumber = inode_create();
+    pthread_mutex_unlock(&table_lock);
+    pthread_rwlock_unlock(&fs_lock);
+    return inumber;
+}
+
+int file_open(int inumber) {
+    if (!mounted) {
+        fprintf(stderr, "file system not mounted yet\n");
+        return -1;
+    }
+
+    if (inumber < 1 || inumber >= ninodes) {
+        fprintf(stderr, "illegal inumber\n");
+        return -1;
+    }
+
+    // already open, share the entry
+    struct fs_file *f = file_find(inumber);
+    if (f) {
+        f->refs++;
+        return f - open_files;
+    }
+
+    f = file_find(0);
+    if (!f) {
+        fprintf(stderr, "cannot open inode %d: too many open files\n", inumber);
+        return -1;
+    }
+
+    inode_load(inumber, &f->inode);
+    if (!f->inode.isvalid) {
+        fprintf(stderr, "cannot open inode %d: inode is not valid\n", inumber);
+        return -1;
+    }
+
+    // a delayed write buffer left by an earlier open holds the data past the size on disk
+    f->disksize = f->inode.size;
+    struct fs_delay *d = delay_find(inumber);
+    if (d) f->inode.size = d->size;
+
+    f->inumber = inumber;
+    f->refs = 1;
+    f->position = 0;
+    f->inode_dirty = 0;
+    f->map_loaded = 0;
+    f->map_dirty = 0;
+    for (int d = 0; d < POINTER_LEVELS; ++d) {
+        f->pointers[d].blocknum = 0;
+        f->pointers[d].dirty = 0;
+    }
+    return f - open_files;
+}
+
+// file_open for a caller that doesn't hold table_lock
+int file_open_locked(int inumber) {
+    pthread_mutex_lock(&table_lock);
+    int fd = file_open(inumber);
+    pthread_mutex_unlock(&table_lock);
+    return fd;
+}
+
+int fs_open(int inumber) {
+    pthread_rwlock_rdlock(&fs_lock);
+    int fd = file_open_locked(inumber);
+    pthread_rwlock_unlock(&fs_lock);
+    return fd;
+}
+
+int file_close(int fd) {
+    struct fs_file *f = file_get(fd);
+    if (!f) return 0;
+
+    if (--f->refs) return 1;
+
+    file_sync(f);
+    f->inumber = 0;
+    return 1;
+}
+
+// file_close for a caller that doesn't hold table_lock
+int file_close_locked(int fd) {
+    pthread_mutex_lock(&table_lock);
+    int ok = file_close(fd);
+    pthread_mutex_unlock(&table_lock);
+    return ok;
+}
+
+int fs_close(int fd) {
+    pthread_rwlock_rdlock(&fs_lock);
+    int ok = file_close_locked(fd);
+    pthread_rwlock_unlock(&fs_lock);
+    return ok;
+}
+
+// release pointer block blocknum and every block below it, levels deep
+// blocks being freed, gathered while they are contiguous. each run is punched out of the image before its
+// blocks are freed, while no other file can have been given them yet
+struct fs_release {
+    int start;
+    int count;
+};
+
+void release_flush(struct fs_release *r) {
+    if (!r->count) return;
+
+    disk_discard(r->start, r->count);
+    for (int b = r->start; b < r->start + r->count; ++b) bitmap_set(b, 0);
+    r->count = 0;
+    return;
+}
+
+void release_block(struct fs_release *r, int blocknum) {
+    if (r->count && r->start + r->count != blocknum) release_flush(r);
+    if (!r->count) r->start = blocknum;
+    r->count++;
+    return;
+}
+
+void free_tree(int blocknum, int levels, struct fs_release *r) {
+    union fs_block pointer_block;
+    disk_read(blocknum, pointer_block.data);
+
+    for (int k = 0; k < POINTERS_PER_BLOCK; ++k) {
+        int b = pointer_block.pointers[k];
+        if (!b) continue;
+
+        if (levels > 1) free_tree(b, levels - 1, r);
+        else release_block(r, b);
+    }
+
+    release_block(r, blocknum);
+    return;
+}
+
+int inode_delete(int inumber) {
     if (!mounted) {
         fprintf(stderr, "file system not mounted yet\n");
         return 0;
@@ -340,6 +2169,11 @@ int fs_delete(int inumber) {
         return 0;
     }
 
+    if (file_find(inumber)) {
+        fprintf(stderr, "cannot delete inode %d: inode is open\n", inumber);
+        return 0;
+    }
+
     struct fs_inode curr;
     inode_load(inumber, &curr);
 
@@ -348,11 +2182,36 @@ int fs_delete(int inumber) {
         return 0;
     }
 
+    // delayed writes never reach the disk, and an incremental defrag of the inode stops
+    struct fs_delay *d = delay_find(inumber);
+    if (d) delay_drop(d);
+    if (defrag_move.inumber == inumber) memset(&defrag_move, 0, sizeof(struct fs_defrag_move));
+
+    // inline data holds no blocks
+    if (curr.flags & FS_INODE_INLINE) memset(&curr, 0, sizeof(struct fs_inode));
+
+    // freed blocks are discarded, so the image only keeps space for live data
+    struct fs_release release = {0, 0};
+
+    // extent mapped
+    if (curr.flags & FS_INODE_EXTENTS) {
+        union fs_block extent_block;
+        if (curr.overflow) disk_read(curr.overflow, extent_block.data);
+
+        for (int k = 0; k < curr.nextents; ++k) {
+            struct fs_extent *e = k < INODE_EXTENTS ? &curr.extent[k] : &extent_block.extents[k - INODE_EXTENTS];
+            for (int b = 0; b < e->length; ++b) release_block(&release, e->start + b);
+        }
+
+        if (curr.overflow) release_block(&release, curr.overflow);
+        memset(&curr, 0, sizeof(struct fs_inode));
+    }
+
     for (int i = 0; i < POINTERS_PER_INODE; ++i) {
         // have data block
         if (curr.direct[i]) {
             // clear data and change bitmap
-            bitmap[curr.direct[i]] = 0;
+            release_block(&release, curr.direct[i]);
             curr.direct[i] = 0;
         }
     }
@@ -368,24 +2227,50 @@ int fs_delete(int inumber) {
             // if valid pointer
             if (pointer_block.pointers[j]) {
                 // clear data and change bitmap
-                bitmap[pointer_block.pointers[j]] = 0;
+                release_block(&release, pointer_block.pointers[j]);
                 pointer_block.pointers[j] = 0;
             }
         }
 
         // release indrect block
-        bitmap[curr.indirect] = 0;
+        release_block(&release, curr.indirect);
         curr.indirect = 0;
     }
 
+    // release double and triple indirect trees
+    if (curr.dindirect) free_tree(curr.dindirect, 2, &release);
+    if (curr.tindirect) free_tree(curr.tindirect, 3, &release);
+    curr.dindirect = 0;
+    curr.tindirect = 0;
+    release_flush(&release);
+
     // change valid bit
     curr.isvalid = 0;
     inode_save(inumber, &curr);
+    bitmap_sync();
+
+    // inode is free again
+    if (inode_map) {
+        bitmap_unmark(inode_map, inumber);
+        if (inumber < inode_hint) inode_hint = inumber;
+    }
+    stream_drop(inumber);
 
     return 1;
 }
 
-int fs_getsize(int inumber) {
+int fs_delete(int inumber) {
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_wrlock(inode_lock(inumber));
+    pthread_mutex_lock(&table_lock);
+    int ok = inode_delete(inumber);
+    pthread_mutex_unlock(&table_lock);
+    pthread_rwlock_unlock(inode_lock(inumber));
+    pthread_rwlock_unlock(&fs_lock);
+    return ok;
+}
+
+int64_t inode_getsize(int inumber) {
     if (!mounted) {
         fprintf(stderr, "file system not mounted yet\n");
         return -1;
@@ -396,6 +2281,12 @@ int fs_getsize(int inumber) {
         return -1;
     }
 
+    // an open file or a delayed write buffer may have a newer size than the inode table
+    struct fs_file *f = file_find(inumber);
+    if (f) return f->inode.size;
+    struct fs_delay *d = delay_find(inumber);
+    if (d) return d->size;
+
     struct fs_inode curr;
     inode_load(inumber, &curr);
 
@@ -404,436 +2295,1736 @@ int fs_getsize(int inumber) {
         return -1;
     }
 
-    return curr.size;
+    return curr.size;
+}
+
+int64_t fs_getsize(int inumber) {
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_rdlock(inode_lock(inumber));
+    int64_t size = inode_getsize(inumber);
+    pthread_rwlock_unlock(inode_lock(inumber));
+    pthread_rwlock_unlock(&fs_lock);
+    return size;
+}
+
+// blocks handed out by get_blocks that the current write has not used yet
+struct fs_run {
+    int start;
+    int count;
+    int group;                  // group to refill from first
+    int taken;                  // blocks run_next returned
+};
+
+// take the next block of a run, refilling it with up to want contiguous blocks. return 0 when the disk is full
+int run_next(struct fs_run *run, int want) {
+    if (!run->count) run->count = get_blocks(run->group, want, &run->start);
+    if (!run->count) return 0;
+
+    run->count--;
+    run->taken++;
+    return run->start++;
+}
+
+// give back the unused part of a run, so the next allocation continues right after the used part
+void run_release(struct fs_run *run) {
+    if (!run->count) return;
+
+    struct fs_group *s = group_of(run->start);
+    pthread_mutex_lock(&s->lock);
+    bitmap_set_run(run->start, run->count, 0);
+    if (s->cursor == run->start + run->count || s->cursor == s->start) s->cursor = run->start;
+    pthread_mutex_unlock(&s->lock);
+    run->count = 0;
+}
+
+// extent k of an extent mapped file
+struct fs_extent *file_extent(struct fs_file *f, int k) {
+    if (k < INODE_EXTENTS) return &f->inode.extent[k];
+
+    // overflow block is read once per open
+    if (!f->map_loaded) {
+        disk_read(f->inode.overflow, f->map.data);
+        f->map_loaded = 1;
+    }
+    return &f->map.extents[k - INODE_EXTENTS];
+}
+
+// number of blocks mapped by the extents of a file. extents map the file from block 0 without holes
+int file_extent_blocks(struct fs_file *f) {
+    int n = 0;
+    for (int k = 0; k < f->inode.nextents; ++k) n += file_extent(f, k)->length;
+    return n;
+}
+
+// pointer block blocknum at level d below the inode, through the pointer cache of the open file.
+// a fresh block starts out zeroed instead of being read
+union fs_block *file_pointers(struct fs_file *f, int d, int blocknum, int fresh) {
+    struct fs_pointers *c = &f->pointers[d];
+
+    if (c->blocknum != blocknum) {
+        if (c->dirty) disk_write(c->blocknum, c->block.data);
+        c->blocknum = blocknum;
+        c->dirty = 0;
+
+        if (fresh) memset(&c->block, 0, sizeof(union fs_block));
+        else disk_read(blocknum, c->block.data);
+    }
+
+    if (fresh) c->dirty = 1;
+    return &c->block;
+}
+
+// slot that maps logical block p of a block mapped file, NULL if a pointer block on the way is missing.
+// with a run, missing pointer blocks are allocated from it. if write is set the slot is marked dirty for
+// the caller to fill
+int *file_slot(struct fs_file *f, int p, struct fs_run *run, int want, int write) {
+    int logical = p;
+    if (p < POINTERS_PER_INODE) {
+        if (write) f->inode_dirty = 1;
+        return &f->inode.direct[p];
+    }
+    p -= POINTERS_PER_INODE;
+
+    // indirect block stays in map for the whole open
+    if (p < POINTERS_PER_BLOCK) {
+        if (!f->inode.indirect) {
+            if (!run) return NULL;
+
+            int indirect = run_next(run, want);
+            if (!indirect) return NULL;
+
+            f->inode.indirect = indirect;
+            f->inode_dirty = 1;
+            rmap_set(indirect, f->inumber, layout_key(logical, 1));
+            memset(&f->map, 0, sizeof(union fs_block));
+            f->map_loaded = 1;
+        } else if (!f->map_loaded) {
+            disk_read(f->inode.indirect, f->map.data);
+            f->map_loaded = 1;
+        }
+
+        if (write) f->map_dirty = 1;
+        return &f->map.pointers[p];
+    }
+    p -= POINTERS_PER_BLOCK;
+
+    // double or triple indirect tree. span is the number of blocks under one pointer at the current level
+    int *slot = &f->inode.dindirect;
+    int levels = 2;
+    int span = POINTERS_PER_BLOCK;
+    if (p >= DIND_BLOCKS) {
+        p -= DIND_BLOCKS;
+        slot = &f->inode.tindirect;
+        levels = 3;
+        span = DIND_BLOCKS;
+    }
+
+    int *dirty = &f->inode_dirty;
+    for (int d = 0; d < levels; ++d) {
+        int fresh = 0;
+        if (!*slot) {
+            if (!run) return NULL;
+
+            int blocknum = run_next(run, want);
+            if (!blocknum) return NULL;
+
+            *slot = blocknum;
+            *dirty = 1;
+            fresh = 1;
+            rmap_set(blocknum, f->inumber, layout_key(logical, levels - d));
+        }
+
+        union fs_block *block = file_pointers(f, d, *slot, fresh);
+        slot = &block->pointers[(p / span) % POINTERS_PER_BLOCK];
+        dirty = &f->pointers[d].dirty;
+        span /= POINTERS_PER_BLOCK;
+    }
+
+    if (write) *dirty = 1;
+    return slot;
+}
+
+// logical block p of the file, 0 if not mapped
+int file_block(struct fs_file *f, int p) {
+    if (f->inode.flags & FS_INODE_EXTENTS) {
+        for (int k = 0; k < f->inode.nextents; ++k) {
+            struct fs_extent *e = file_extent(f, k);
+            if (p < e->length) return e->start + p;
+            p -= e->length;
+        }
+        return 0;
+    }
+
+    int *slot = file_slot(f, p, NULL, 0, 0);
+    return slot ? *slot : 0;
+}
+
+// physical block of logical block p in *blocknum (0 if not mapped), return how many of the
+// next n logical blocks follow it contiguously on disk
+int file_run(struct fs_file *f, int p, int n, int *blocknum) {
+    *blocknum = file_block(f, p);
+    if (!*blocknum) return 1;
+
+    int run = 1;
+    if (f->inode.flags & FS_INODE_EXTENTS) {
+        // rest of the extent holding p
+        for (int k = 0; k < f->inode.nextents; ++k) {
+            struct fs_extent *e = file_extent(f, k);
+            if (*blocknum >= e->start && *blocknum < e->start + e->length) {
+                run = e->start + e->length - *blocknum;
+                break;
+            }
+        }
+    } else {
+        while (run < n && file_block(f, p + run) == *blocknum + run) run++;
+    }
+    return run < n ? run : n;
+}
+
+// number of blocks a transfer of length bytes touches, starting offset_p bytes into a block. at most MAX_IO_BLOCKS
+int io_blocks(int offset_p, int length) {
+    int n = (offset_p + length - 1) / DISK_BLOCK_SIZE + 1;
+    return n < MAX_IO_BLOCKS ? n : MAX_IO_BLOCKS;
+}
+
+// load file blocks from..to-1 into the block cache, one disk request per contiguous run
+void readahead_fill(struct fs_file *f, int from, int to) {
+    __atomic_add_fetch(&readahead_fills, 1, __ATOMIC_RELAXED);
+    while (from < to) {
+        int blocknum;
+        int run = file_run(f, from, to - from, &blocknum);
+        if (blocknum) __atomic_add_fetch(&readahead_blocks, disk_prefetch(blocknum, run), __ATOMIC_RELAXED);
+        from += run;
+    }
+    return;
+}
+
+// note a read of file blocks first..last. a read that starts where the previous read of the inode ended
+// continues a sequential stream: the window past it is loaded into the block cache ahead of time,
+// refilled once less than half of it is left and doubled on every refill. return 1 if the read is to be
+// copied out of the cache. the caller holds f->lock
+int readahead(struct fs_file *f, int first, int last) {
+    if (!readahead_limit) return 0;
+
+    pthread_mutex_lock(&table_lock);
+    struct fs_stream *s = stream_get(f->inumber);
+    int sequential = first == s->next || first + 1 == s->next;
+    s->next = last + 1;
+
+    // random reads, and reads too large for the cache, go to the disk directly
+    if (!sequential || last - first >= readahead_limit) {
+        s->window = 0;
+        pthread_mutex_unlock(&table_lock);
+        return 0;
+    }
+
+    if (!s->window) {
+        s->window = READAHEAD_MIN;
+        s->ahead = first;
+    }
+    if (s->ahead < first) s->ahead = first;
+
+    // the window is claimed under the table lock and filled outside it
+    int from = s->ahead, to = s->ahead;
+    if (s->ahead - (last + 1) < s->window / 2) {
+        int64_t end = last + 1 + s->window;
+        int64_t size = (f->inode.size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+        if (end > size) end = size;
+
+        if (s->ahead < end) to = end;
+        s->ahead = end;
+        s->window = s->window * 2 < readahead_limit ? s->window * 2 : readahead_limit;
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    if (from < to) readahead_fill(f, from, to);
+    return 1;
+}
+
+void fs_readahead_stats(struct fs_readahead_stats *stats) {
+    struct disk_stats d;
+    disk_get_stats(&d);
+
+    pthread_mutex_lock(&table_lock);
+    memset(stats, 0, sizeof(struct fs_readahead_stats));
+    for (int i = 0; i < READAHEAD_STREAMS; ++i) {
+        if (!streams[i].inumber || !streams[i].window) continue;
+        stats->streams++;
+        stats->window_total += streams[i].window;
+        if (streams[i].window > stats->window_max) stats->window_max = streams[i].window;
+    }
+    stats->window_limit = readahead_limit;
+    stats->fills = readahead_fills;
+    stats->blocks = readahead_blocks;
+    stats->hits = mounted ? d.prefetch_hits - readahead_base_hits : 0;
+    pthread_mutex_unlock(&table_lock);
+    return;
+}
+
+int file_pread(struct fs_file *f, char *data, int length, int64_t offset) {
+    if (!length) {
+        fprintf(stderr, "cannot read 0 byte\n");
+        return 0;
+    }
+
+    if (offset > f->inode.size) {
+        fprintf(stderr, "offset is larger than size\n");
+        return 0;
+    }
+
+    // adjust length if exceed
+    if (f->inode.size < offset + length)
+        length = f->inode.size - offset;
+
+    // inline, the bytes came in with the inode
+    if (f->inode.flags & FS_INODE_INLINE) {
+        memcpy(data, f->inode.inline_data + offset, length);
+        pthread_mutex_lock(&f->lock);
+        f->position = offset + length;
+        pthread_mutex_unlock(&f->lock);
+        return length;
+    }
+
+    // the part past the blocks on disk comes out of the delayed write buffer. only a writer of the
+    // inode changes it, so it can be copied after the table lock is dropped
+    pthread_mutex_lock(&table_lock);
+    struct fs_delay *d = delay_find(f->inumber);
+    pthread_mutex_unlock(&table_lock);
+    int buffered = 0;
+    if (d && offset + length > (int64_t) d->start * DISK_BLOCK_SIZE) {
+        int64_t split = (int64_t) d->start * DISK_BLOCK_SIZE;
+        int64_t from = offset > split ? offset : split;
+        buffered = offset + length - from;
+        memcpy(data + (from - offset), d->data + (from - split), buffered);
+        length -= buffered;
+    }
+
+    int read_data = 0;
+    int p = offset / DISK_BLOCK_SIZE;
+    int offset_p = offset % DISK_BLOCK_SIZE;
+
+    // sequential streams are read ahead into the block cache and copied out of it. readers of
+    // the same file share its pointer block cache, which f->lock guards
+    pthread_mutex_lock(&f->lock);
+    int streaming = length && readahead(f, p, (offset + length - 1) / DISK_BLOCK_SIZE);
+    pthread_mutex_unlock(&f->lock);
+
+    // any other read of more than one block is queued as a whole and reaped at once.
+    // partial first and last blocks are copied out of head and tail after the wait
+    int batch = !streaming && io_blocks(offset_p, length) > 1;
+    char *head = NULL, *tail = NULL;
+    char *head_dest = NULL, *tail_dest = NULL;
+    int head_offset = 0, tail_length = 0;
+
+    while (length) {
+        // blocks that are contiguous on disk, out of those the rest of the read touches
+        int blocknum;
+        pthread_mutex_lock(&f->lock);
+        int run = file_run(f, p, io_blocks(offset_p, length), &blocknum);
+        pthread_mutex_unlock(&f->lock);
+
+        // size of read
+        int to_read = run * DISK_BLOCK_SIZE - offset_p;
+        if (to_read > length) to_read = length;
+
+        char *image = blocknum ? disk_map_block(blocknum, run) : NULL;
+        if (image) {
+            // mapped disk, copy straight out of the image
+            memcpy(data+read_data, image+offset_p, to_read);
+            disk_unmap_block(run, 0);
+        } else if (blocknum && streaming) {
+            // read ahead already, whole blocks are copied straight out of the cache
+            int done = 0;
+            for (int b = blocknum; done < to_read; ++b) {
+                int n = DISK_BLOCK_SIZE - offset_p;
+                if (n > to_read - done) n = to_read - done;
+
+                if (n == DISK_BLOCK_SIZE) {
+                    disk_read(b, data+read_data+done);
+                } else {
+                    char *block = disk_buffer_get();
+                    disk_read(b, block);
+                    memcpy(data+read_data+done, block+offset_p, n);
+                    disk_buffer_put(block);
+                }
+                done += n;
+                offset_p = 0;
+            }
+        } else if (blocknum && batch) {
+            // whole blocks land in the caller's buffer, a partial first or last block in a spare one until the wait
+            int b = blocknum, n = run;
+            char *dest = data+read_data;
+            int tail_bytes = (offset_p + to_read) % DISK_BLOCK_SIZE;
+
+            if (offset_p) {
+                head = disk_buffer_get();
+                disk_submit_read(b, 1, head);
+                head_offset = offset_p;
+                head_dest = dest;
+                dest += DISK_BLOCK_SIZE - offset_p;
+                b++;
+                n--;
+            }
+
+            if (tail_bytes) n--;
+            if (n) disk_submit_read(b, n, dest);
+
+            if (tail_bytes) {
+                tail = disk_buffer_get();
+                disk_submit_read(b + n, 1, tail);
+                tail_length = tail_bytes;
+                tail_dest = data+read_data+to_read-tail_bytes;
+            }
+        } else if (blocknum) {
+            char *block = disk_buffer_get();
+            disk_read(blocknum, block);
+
+            // copy data
+            memcpy(data+read_data, block+offset_p, to_read);
+            disk_buffer_put(block);
+        } else {
+            // never written, reads as zeros
+            memset(data+read_data, 0, to_read);
+        }
+
+        read_data += to_read;
+        offset_p = 0;
+        length -= to_read;
+        p += run;
+    }
+
+    if (batch) {
+        disk_wait();
+        if (head_dest) memcpy(head_dest, head+head_offset, DISK_BLOCK_SIZE - head_offset);
+        if (tail_dest) memcpy(tail_dest, tail, tail_length);
+    }
+    if (head) disk_buffer_put(head);
+    if (tail) disk_buffer_put(tail);
+
+    read_data += buffered;
+    pthread_mutex_lock(&f->lock);
+    f->position = offset + read_data;
+    pthread_mutex_unlock(&f->lock);
+    return read_data;
+}
+
+int fs_pread(int fd, char *data, int length, int64_t offset) {
+    pthread_rwlock_rdlock(&fs_lock);
+    struct fs_file *f = file_get(fd);
+    int read_data = 0;
+    if (f) {
+        pthread_rwlock_rdlock(inode_lock(f->inumber));
+        read_data = file_pread(f, data, length, offset);
+        pthread_rwlock_unlock(inode_lock(f->inumber));
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    return read_data;
+}
+
+// add blocks start..start+length-1 to the end of an extent mapped file. return 0 when there is no room for another extent
+int extent_append(struct fs_file *f, int start, int length) {
+    int n = f->inode.nextents;
+
+    // continues the last extent
+    if (n) {
+        struct fs_extent *e = file_extent(f, n - 1);
+        if (e->start + e->length == start) {
+            e->length += length;
+            if (n > INODE_EXTENTS) f->map_dirty = 1;
+            else f->inode_dirty = 1;
+            return 1;
+        }
+    }
+
+    if (n == MAX_EXTENTS) {
+        fprintf(stderr, "inode %d has too many extents\n", f->inumber);
+        return 0;
+    }
+
+    // first extent past the inode needs the overflow block
+    if (n == INODE_EXTENTS && !f->inode.overflow) {
+        int overflow = get_block(inode_group(f->inumber));
+        if (!overflow) return 0;
+
+        f->inode.overflow = overflow;
+        memset(&f->map, 0, sizeof(union fs_block));
+        f->map_loaded = 1;
+        rmap_set(overflow, f->inumber, -1);
+    }
+
+    struct fs_extent *e = file_extent(f, n);
+    e->start = start;
+    e->length = length;
+    f->inode.nextents++;
+    f->inode_dirty = 1;
+    if (n >= INODE_EXTENTS) f->map_dirty = 1;
+    return 1;
+}
+
+// extent mapped files only grow at the end: blocks from the end up to last are allocated in runs
+// as long as the allocator can find, and blocks before first that the write skips over are zeroed.
+// return the last block that is mapped
+int extent_allocate(struct fs_file *f, int first, int last) {
+    int p = file_extent_blocks(f);
+
+    while (p <= last) {
+        struct fs_run run = {0, 0, 0, 0};
+        run.count = get_blocks(inode_group(f->inumber), last - p + 1, &run.start);
+
+        // disk is full
+        if (!run.count) break;
+
+        if (!extent_append(f, run.start, run.count)) {
+            run_release(&run);
+            break;
+        }
+
+        for (int i = 0; i < run.count && p + i < first; ++i) disk_write(run.start + i, emptyblock);
+        rmap_set_run(run.start, run.count, f->inumber, p);
+        p += run.count;
+    }
+
+    return p - 1;
+}
+
+// pointer blocks missing to map blocks lo..hi below blocknum, the top of a tree of levels pointer blocks at
+// level d of the pointer cache. blocknum is 0 if the top block is missing too. span is the number of blocks
+// under one pointer of the top block
+int tree_missing(struct fs_file *f, int blocknum, int d, int levels, int span, int lo, int hi) {
+    int missing = !blocknum;
+    if (levels == 1) return missing;
+
+    union fs_block *block = blocknum ? file_pointers(f, d, blocknum, 0) : NULL;
+    for (int c = lo / span; c <= hi / span; ++c) {
+        int child = block ? block->pointers[c] : 0;
+        int child_lo = c == lo / span ? lo % span : 0;
+        int child_hi = c == hi / span ? hi % span : span - 1;
+        missing += tree_missing(f, child, d + 1, levels - 1, span / POINTERS_PER_BLOCK, child_lo, child_hi);
+    }
+    return missing;
+}
+
+// pointer blocks a block mapped file needs besides the ones it has, to map blocks first..last
+int file_missing_pointers(struct fs_file *f, int first, int last) {
+    int missing = 0;
+    int lo = POINTERS_PER_INODE;
+    int hi = lo + POINTERS_PER_BLOCK - 1;
+    if (first <= hi && last >= lo && !f->inode.indirect) missing++;
+
+    lo = hi + 1;
+    hi = lo + DIND_BLOCKS - 1;
+    if (first <= hi && last >= lo) {
+        missing += tree_missing(f, f->inode.dindirect, 0, 2, POINTERS_PER_BLOCK,
+                                (first > lo ? first : lo) - lo, (last < hi ? last : hi) - lo);
+    }
+
+    lo = hi + 1;
+    if (last >= lo) missing += tree_missing(f, f->inode.tindirect, 0, 3, DIND_BLOCKS, (first > lo ? first : lo) - lo, last - lo);
+    return missing;
+}
+
+// map blocks first..last of the file, allocating the missing ones (and the pointer blocks) from as few runs as possible.
+// return the last block that is mapped, less than last when the disk fills up
+int file_allocate(struct fs_file *f, int first, int last) {
+    if (f->inode.flags & FS_INODE_EXTENTS) return extent_allocate(f, first, last);
+
+    // count what is missing before allocating anything
+    int missing = 0;
+    for (int p = first; p <= last; ++p) {
+        if (!file_block(f, p)) missing++;
+    }
+    if (!missing) return last;
+
+    // and the pointer blocks on the way, so a run taken later holds exactly the blocks still to come
+    missing += file_missing_pointers(f, first, last);
+
+    struct fs_run run = {0, 0, inode_group(f->inumber), 0};
+    int p;
+    for (p = first; p <= last; ++p) {
+        if (file_block(f, p)) continue;
+
+        // allocates the pointer blocks p needs
+        int *slot = file_slot(f, p, &run, missing - run.taken, 1);
+
+        // disk is full
+        if (!slot) break;
+
+        int blocknum = run_next(&run, missing - run.taken);
+
+        // disk is full
+        if (!blocknum) break;
+
+        *slot = blocknum;
+        rmap_set(blocknum, f->inumber, layout_key(p, 0));
+    }
+
+    // give back unused blocks
+    run_release(&run);
+    return p - 1;
+}
+
+// write length bytes at offset, allocating the blocks the write needs right away
+int file_write(struct fs_file *f, const char *data, int length, int64_t offset) {
+    int first = offset / DISK_BLOCK_SIZE;
+    int last = (offset + length - 1) / DISK_BLOCK_SIZE;
+
+    // partial first and last blocks that are new must start from zeros, not from an old file's data
+    int fresh_first = !file_block(f, first);
+    int fresh_last = !file_block(f, last);
+
+    // map the whole range before writing any data. stop where the disk filled up
+    int mapped = file_allocate(f, first, last);
+    if (mapped < first) return 0;
+    if (offset + length > (int64_t) (mapped + 1) * DISK_BLOCK_SIZE) length = (int64_t) (mapped + 1) * DISK_BLOCK_SIZE - offset;
+
+    int write_data = 0;
+    int p = first;
+    int offset_p = offset % DISK_BLOCK_SIZE;
+
+    // a write of more than one block is queued as a whole and completes at once
+    int batch = last > first;
+    char *head = NULL, *tail = NULL;
+
+    while (length) {
+        // blocks that are contiguous on disk, out of those the rest of the write touches
+        int blocknum;
+        int run = file_run(f, p, io_blocks(offset_p, length), &blocknum);
+
+        // size of write
+        int to_write = run * DISK_BLOCK_SIZE - offset_p;
+        if (to_write > length) to_write = length;
+
+        char *image = disk_map_block(blocknum, run);
+        if (image) {
+            // mapped disk, copy straight into the image. new blocks are zeroed around the data
+            int tail_bytes = (offset_p + to_write) % DISK_BLOCK_SIZE;
+            if (offset_p && p == first && fresh_first) memset(image, 0, offset_p);
+            if (tail_bytes && p + run - 1 == last && fresh_last) memset(image+offset_p+to_write, 0, DISK_BLOCK_SIZE - tail_bytes);
+
+            memcpy(image+offset_p, data+write_data, to_write);
+            disk_unmap_block(run, 1);
+        } else if (batch) {
+            // whole blocks go straight from the caller's buffer, a partial first or last block is merged into a spare one
+            int b = blocknum, n = run;
+            const char *src = data+write_data;
+            int tail_bytes = (offset_p + to_write) % DISK_BLOCK_SIZE;
+
+            if (offset_p) {
+                head = disk_buffer_get();
+                if (p == first && fresh_first) memset(head, 0, DISK_BLOCK_SIZE);
+                else disk_read(b, head);
+                memcpy(head+offset_p, src, DISK_BLOCK_SIZE - offset_p);
+
+                disk_submit_write(b, 1, head);
+                src += DISK_BLOCK_SIZE - offset_p;
+                b++;
+                n--;
+            }
+
+            if (tail_bytes) {
+                tail = disk_buffer_get();
+                if (p + run - 1 == last && fresh_last) memset(tail, 0, DISK_BLOCK_SIZE);
+                else disk_read(b + n - 1, tail);
+                memcpy(tail, data+write_data+to_write-tail_bytes, tail_bytes);
+                n--;
+            }
+
+            if (n) disk_submit_write(b, n, src);
+            if (tail_bytes) disk_submit_write(b + n, 1, tail);
+        } else if (to_write == DISK_BLOCK_SIZE) {
+            // whole block, no need to read the old contents
+            disk_write(blocknum, data+write_data);
+        } else {
+            char *block = disk_buffer_get();
+            if ((p == first && fresh_first) || (p == last && fresh_last)) memset(block, 0, DISK_BLOCK_SIZE);
+            else disk_read(blocknum, block);
+
+            // copy data
+            memcpy(block+offset_p, data+write_data, to_write);
+
+            // write back
+            disk_write(blocknum, block);
+            disk_buffer_put(block);
+        }
+
+        write_data += to_write;
+        offset_p = 0;
+        length -= to_write;
+        p += run;
+    }
+    if (batch) disk_wait();
+    if (head) disk_buffer_put(head);
+    if (tail) disk_buffer_put(tail);
+
+    // update inode size if necessary. the data is on disk, so the saved size covers it
+    if (f->inode.size < offset + write_data) {
+        f->inode.size = offset + write_data;
+        f->inode_dirty = 1;
+    }
+    if (f->disksize < offset + write_data) f->disksize = offset + write_data;
+
+    f->position = offset + write_data;
+    return write_data;
 }
 
-int fs_read(int inumber, char *data, int length, int offset) {
-    if (!mounted) {
-        fprintf(stderr, "file system not mounted yet\n");
-        return 0;
+// write a delayed write buffer out. the blocks are allocated now, as one run if the disk has one.
+// return 0 if some of the data could not be written, in which case the file is cut off where it ends
+int delay_flush(struct fs_file *f, struct fs_delay *d) {
+    int64_t split = (int64_t) d->start * DISK_BLOCK_SIZE;
+    int length = 0;
+    if (f->inode.size > split) length = f->inode.size - split;
+    if (length > d->nblocks * DISK_BLOCK_SIZE) length = d->nblocks * DISK_BLOCK_SIZE;
+
+    // the reservation goes first so the write can allocate from it
+    int inumber = d->inumber;
+    char *data = d->data;
+    d->data = NULL;
+    delay_drop(d);
+
+    int write_data = length ? file_write(f, data, length, split) : 0;
+    free(data);
+
+    // the data has blocks now, and the size saved with the inode moves up to it
+    if (f->disksize < split + write_data) f->disksize = split + write_data;
+    f->inode_dirty = 1;
+    if (write_data == length) return 1;
+
+    // the size must not cover data that is not on disk
+    fprintf(stderr, "inode %d: %d bytes of delayed writes could not be written\n", inumber, length - write_data);
+    f->inode.size = split + write_data;
+    return 0;
+}
+
+// flush the delayed write buffer of an inode that may not be open. return 0 if it couldn't be opened
+// or not all of its data could be written
+int delay_flush_inode(struct fs_delay *d) {
+    // the owner may be reading or writing it right now, in which case the buffer stays
+    pthread_rwlock_t *lock = inode_lock(d->inumber);
+    if (pthread_rwlock_trywrlock(lock)) return 0;
+
+    int ok = 0;
+    int fd = file_open_locked(d->inumber);
+    if (fd >= 0) {
+        ok = delay_flush(&open_files[fd], d);
+        file_close_locked(fd);
     }
+    pthread_rwlock_unlock(lock);
+    return ok;
+}
 
-    if (inumber < 1 || inumber >= ninodes) {
-        fprintf(stderr, "illegal inumber\n");
-        return 0;
+// least recently written delayed write buffer other than keep, NULL if there is none
+struct fs_delay *delay_victim(struct fs_delay *keep) {
+    struct fs_delay *d = NULL;
+    for (int i = 0; i < DELAY_FILES; ++i) {
+        if (!delays[i].inumber || &delays[i] == keep) continue;
+        if (!d || delays[i].used < d->used) d = &delays[i];
     }
+    return d;
+}
 
-    struct fs_inode curr;
-    inode_load(inumber, &curr);
+// a free delayed write buffer, flushing the least recently written one if there is none
+struct fs_delay *delay_slot() {
+    struct fs_delay *d = delay_find(0);
+    if (d) return d;
 
-    if (!length) {
-        fprintf(stderr, "cannot read 0 byte\n");
-        return 0;
-    }
+    d = delay_victim(NULL);
+    if (!d || !delay_flush_inode(d)) return NULL;
+    return d;
+}
 
-    if (!curr.isvalid) {
-        fprintf(stderr, "cannot read from inode %d: inode is not valid\n", inumber);
-        return 0;
-    }
+// most blocks a delayed write buffer of f may hold. on a fragmented disk the flush of an extent file may
+// take an extent for every block, so the buffer never holds more blocks than the extent map has room for
+int delay_limit(struct fs_file *f) {
+    if (!(f->inode.flags & FS_INODE_EXTENTS)) return DELAY_MAX_BLOCKS;
 
-    if (offset > curr.size) {
-        fprintf(stderr, "offset is larger than size\n");
-        return 0;
+    int room = MAX_EXTENTS - f->inode.nextents;
+    return room < DELAY_MAX_BLOCKS ? room : DELAY_MAX_BLOCKS;
+}
+
+// delayed write buffer for a write of f that ends in file block last, grown to cover it.
+// NULL if the write doesn't reach past the blocks on disk or has to go to disk right away
+struct fs_delay *delay_prepare(struct fs_file *f, int last) {
+    struct fs_delay *d = delay_find(f->inumber);
+    int start = d ? d->start : (f->inode.size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    if (last < start) return NULL;
+
+    // a full buffer goes to disk and the write starts a new one past it
+    if (d && last - start >= delay_limit(f)) {
+        if (!delay_flush(f, d)) return NULL;
+        d = NULL;
+        start = (f->inode.size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+        if (last < start) return NULL;
     }
 
-    // adjust length if exceed
-    if (curr.size < offset + length)
-        length = curr.size - offset;
+    // too large to buffer, or a sparse write far past the end
+    if (last - start >= delay_limit(f)) return NULL;
 
+    if (!d) {
+        d = delay_slot();
+        if (!d) return NULL;
+        d->inumber = f->inumber;
+        d->start = start;
+        d->size = f->inode.size;
+    }
 
-    int read_data = 0;
-    int p = offset / DISK_BLOCK_SIZE;
-    int offset_p = offset % DISK_BLOCK_SIZE;
+    int nblocks = last - start + 1;
+    if (nblocks > d->nblocks) {
+        int more = nblocks - d->nblocks;
 
-    while (length && p < POINTERS_PER_INODE) {
-        union fs_block block;
-        //printf("read from %d\n", curr.direct[p]);
-        disk_read(curr.direct[p], block.data);
+        // stay within the memory budget by flushing other inodes
+        while (delay_total + more > DELAY_BUDGET) {
+            struct fs_delay *victim = delay_victim(d);
+            if (!victim || !delay_flush_inode(victim)) break;
+        }
 
-        // size of read
-        int to_read;
-        if (offset_p + length > DISK_BLOCK_SIZE) to_read = DISK_BLOCK_SIZE - offset_p;
-        else to_read = length - offset_p;
+        // hold back enough free blocks for the data and the pointer blocks mapping it
+        int reserve = nblocks + nblocks / POINTERS_PER_BLOCK + POINTER_LEVELS;
+        int avail = __atomic_load_n(&nfree, __ATOMIC_RELAXED) - __atomic_load_n(&delay_reserved, __ATOMIC_RELAXED);
+        if (delay_total + more > DELAY_BUDGET || avail < reserve - d->reserved) {
+            delay_flush(f, d);
+            return NULL;
+        }
 
-        // copy data
-        memcpy(data+read_data, block.data+offset_p, to_read);
+        if (nblocks > d->capacity) {
+            int capacity = d->capacity ? d->capacity : 16;
+            while (capacity < nblocks) capacity *= 2;
+            if (capacity > DELAY_MAX_BLOCKS) capacity = DELAY_MAX_BLOCKS;
 
-        read_data += to_read;
-        offset_p = 0;
-        length -= to_read;
-        p++;
+            char *data = (char*) realloc(d->data, (size_t) capacity * DISK_BLOCK_SIZE);
+            if (!data) {
+                delay_flush(f, d);
+                return NULL;
+            }
+            d->data = data;
+            d->capacity = capacity;
+        }
+
+        // blocks never written read as zeros
+        memset(d->data + (size_t) d->nblocks * DISK_BLOCK_SIZE, 0, (size_t) more * DISK_BLOCK_SIZE);
+        delay_total += more;
+        __atomic_add_fetch(&delay_reserved, reserve - d->reserved, __ATOMIC_RELAXED);
+        d->reserved = reserve;
+        d->nblocks = nblocks;
     }
 
-    // finished within direct pointers
-    if (!length) return read_data;
+    d->used = ++delay_clock;
+    return d;
+}
 
-    // read indriect pointer
-    union fs_block pointer_block;
-    disk_read(curr.indirect, pointer_block.data);
-    p -= POINTERS_PER_INODE;
+int file_pwrite(struct fs_file *f, const char *data, int length, int64_t offset) {
+    if (!length) {
+        fprintf(stderr, "cannot write 0 byte\n");
+        return 0;
+    }
 
-    // read from block pointed by the pointers in the pointer block
-    while (length) {
-        // get data block
-        union fs_block block;
-        disk_read(pointer_block.pointers[p], block.data);
+    // largest file the inode format can map
+    int64_t max_size = (int64_t) MAX_FILE_BLOCKS * DISK_BLOCK_SIZE;
+    if (f->inode.flags & FS_INODE_EXTENTS) max_size = (int64_t) MAX_EXTENT_BLOCKS * DISK_BLOCK_SIZE;
+    else if (fs_version == FS_FORMAT_INDIRECT) max_size = (int64_t) MAX_INDIRECT_BLOCKS * DISK_BLOCK_SIZE;
+
+    if (offset >= max_size) return 0;
+    if (length > max_size - offset) length = max_size - offset;
+
+    // an inline file that is still small enough is written in the inode
+    if ((f->inode.flags & FS_INODE_INLINE) && offset + length <= INODE_INLINE) {
+        memcpy(f->inode.inline_data + offset, data, length);
+        if (f->inode.size < offset + length) f->inode.size = offset + length;
+        f->disksize = f->inode.size;
+        f->inode_dirty = 1;
+        f->position = offset + length;
+        return length;
+    }
 
-        int to_read;
-        if (offset_p + length > DISK_BLOCK_SIZE) to_read = DISK_BLOCK_SIZE - offset_p;
-        else to_read = length - offset_p;
+    // one that grows past it becomes an empty block mapped file, and its bytes are written again
+    // through the usual path, so they get the same block as the data following them
+    if (f->inode.flags & FS_INODE_INLINE) {
+        char inline_data[INODE_INLINE];
+        int size = f->inode.size;
+        memcpy(inline_data, f->inode.inline_data, INODE_INLINE);
+        memset(f->inode.inline_data, 0, INODE_INLINE);
+        f->inode.flags &= ~FS_INODE_INLINE;
+        f->inode.size = 0;
+        f->disksize = 0;
+        f->inode_dirty = 1;
+
+        // no room for the block, the file stays inline
+        if (size && file_pwrite(f, inline_data, size, 0) != size) {
+            memcpy(f->inode.inline_data, inline_data, INODE_INLINE);
+            f->inode.flags |= FS_INODE_INLINE;
+            f->inode.size = size;
+            f->disksize = size;
+            return 0;
+        }
+    }
 
-        // copy data
-        memcpy(data+read_data, block.data+offset_p, to_read);
+    // data past the blocks the file has on disk is buffered. the part of the write before them goes to disk now
+    pthread_mutex_lock(&table_lock);
+    struct fs_delay *d = delay_prepare(f, (offset + length - 1) / DISK_BLOCK_SIZE);
+    pthread_mutex_unlock(&table_lock);
+    if (!d) return file_write(f, data, length, offset);
 
-        read_data += to_read;
-        offset_p = 0;
-        length -= to_read;
-        p++;
+    int64_t split = (int64_t) d->start * DISK_BLOCK_SIZE;
+    int write_data = 0;
+    if (offset < split) {
+        write_data = file_write(f, data, split - offset, offset);
+        if (write_data < split - offset) return write_data;
     }
+    memcpy(d->data + (offset + write_data - split), data + write_data, length - write_data);
 
-    return read_data;
+    // only the size in memory grows. the saved size waits for delay_flush to give the data blocks
+    if (f->inode.size < offset + length) {
+        f->inode.size = offset + length;
+        d->size = f->inode.size;
+    }
+
+    f->position = offset + length;
+    return length;
 }
 
-// update inode size if necessary
-void wrap_up_write(int inumber, int offset, int write_data, struct fs_inode *curr) {
-    if (curr->size < offset + write_data) {
-        curr->size = offset + write_data;
-        inode_save(inumber, curr);
+int fs_pwrite(int fd, const char *data, int length, int64_t offset) {
+    pthread_rwlock_rdlock(&fs_lock);
+    struct fs_file *f = file_get(fd);
+    int write_data = 0;
+    if (f) {
+        pthread_rwlock_wrlock(inode_lock(f->inumber));
+        write_data = file_pwrite(f, data, length, offset);
+        pthread_rwlock_unlock(inode_lock(f->inumber));
     }
-
+    pthread_rwlock_unlock(&fs_lock);
+    return write_data;
 }
 
-int fs_write(int inumber, const char *data, int length, int offset) {
+// write every delayed write buffer to disk
+int sync_delays() {
     if (!mounted) {
         fprintf(stderr, "file system not mounted yet\n");
         return 0;
     }
 
-    if (inumber < 1 || inumber >= ninodes) {
-        fprintf(stderr, "illegal inumber\n");
-        return 0;
-    }
-
-    struct fs_inode curr;
-    inode_load(inumber, &curr);
-
-    if (!length) {
-        fprintf(stderr, "cannot write 0 byte\n");
-        return 0;
+    int ok = 1;
+    for (int i = 0; i < DELAY_FILES; ++i) {
+        if (delays[i].inumber && !delay_flush_inode(&delays[i])) ok = 0;
     }
+    return ok;
+}
 
-    if (!curr.isvalid) {
-        fprintf(stderr, "cannot write to inode %d: inode is not valid\n", inumber);
-        return 0;
+int fs_sync() {
+    pthread_rwlock_wrlock(&fs_lock);
+    int ok = sync_delays();
+    if (mounted) {
+        bitmap_sync();
+        rmap_sync(0);
     }
+    pthread_rwlock_unlock(&fs_lock);
+    return ok;
+}
 
-    int write_data = 0;
-    int p = offset / DISK_BLOCK_SIZE;
-    int offset_p = offset % DISK_BLOCK_SIZE;
+int fs_read(int inumber, char *data, int length, int64_t offset) {
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_rdlock(inode_lock(inumber));
 
-    while (length && p < POINTERS_PER_INODE) {
-        union fs_block block;
-        
-        if (!curr.direct[p]) {
-            int new_block_num = get_block();
+    int read_data = 0;
+    int fd = file_open_locked(inumber);
+    if (fd >= 0) {
+        read_data = file_pread(&open_files[fd], data, length, offset);
+        file_close_locked(fd);
+    }
 
-            // disk is full
-            if (!new_block_num) {
-                wrap_up_write(inumber, offset, write_data, &curr);
-                return write_data;
-            } 
+    pthread_rwlock_unlock(inode_lock(inumber));
+    pthread_rwlock_unlock(&fs_lock);
+    return read_data;
+}
 
-            // change belong map
-            memset(&belong[new_block_num], 0, sizeof(struct fs_belong));
-            belong[new_block_num].inode = inumber;
-            belong[new_block_num].direct_pointer = p+1;
+int fs_write(int inumber, const char *data, int length, int64_t offset) {
+    pthread_rwlock_rdlock(&fs_lock);
+    pthread_rwlock_wrlock(inode_lock(inumber));
 
-            // update inode
-            curr.direct[p] = new_block_num;
-            inode_save(inumber, &curr);
-        }
-        disk_read(curr.direct[p], block.data);
+    int write_data = 0;
+    int fd = file_open_locked(inumber);
+    if (fd >= 0) {
+        write_data = file_pwrite(&open_files[fd], data, length, offset);
+        file_close_locked(fd);
+    }
 
-        // size of write
-        int to_write;
-        if (offset_p + length > DISK_BLOCK_SIZE) to_write = DISK_BLOCK_SIZE - offset_p;
-        else to_write = length - offset_p;
+    pthread_rwlock_unlock(inode_lock(inumber));
+    pthread_rwlock_unlock(&fs_lock);
+    return write_data;
+}
 
-        // copy data
-        memcpy(block.data+offset_p, data+write_data, to_write);
+// destination of every block during relayout, by its place before the relayout
+int *relayout_dest;
 
-        // write back
-        disk_write(curr.direct[p], block.data);
+// point the moved pointer block at blocknum, and the blocks under it, at the new places of their blocks
+void relayout_update_tree(int blocknum, int levels) {
+    union fs_block pointer_block;
+    disk_read(blocknum, pointer_block.data);
 
+    for (int k = 0; k < POINTERS_PER_BLOCK; ++k) {
+        int *b = &pointer_block.pointers[k];
+        if (!*b) continue;
 
-        write_data += to_write;
-        offset_p = 0;
-        length -= to_write;
-        p++;
+        *b = relayout_dest[*b];
+        if (levels > 1) relayout_update_tree(*b, levels - 1);
     }
 
-    // finished within direct pointers
-    if (!length) {
-        wrap_up_write(inumber, offset, write_data, &curr);
-        return write_data;
-    } 
-
-    // read indriect pointer
-    union fs_block pointer_block;
-    if (!curr.indirect) {
-        int new_block_num = get_block();
+    disk_write(blocknum, pointer_block.data);
+    return;
+}
 
-        // disk is full
-        if (!new_block_num) {
-            wrap_up_write(inumber, offset, write_data, &curr);
-            return write_data;
-        } 
+// data movement of a relayout. a dry run only counts it
+int defrag_dry;
+struct fs_defrag_stats defrag_stats;
 
-        // change belong map
-        memset(&belong[new_block_num], 0, sizeof(struct fs_belong));
-        belong[new_block_num].inode = inumber;
-        belong[new_block_num].indirect_pointer = 1;
+void defrag_read(int blocknum, int n, char *data) {
+    defrag_stats.reads += n;
+    defrag_stats.read_requests++;
+    if (!defrag_dry) disk_read_blocks(blocknum, n, data);
+    return;
+}
 
-        curr.indirect = new_block_num;
-        inode_save(inumber, &curr);
+void defrag_write(int blocknum, int n, const char *data) {
+    defrag_stats.writes += n;
+    defrag_stats.write_requests++;
+    if (!defrag_dry) disk_write_blocks(blocknum, n, data);
+    return;
+}
 
-        // initialize indirect block
-        union fs_block indirect_block;
-        disk_read(new_block_num, indirect_block.data);
-        memset(&indirect_block, 0, sizeof(union fs_block));
-        disk_write(new_block_num, indirect_block.data);
+void defrag_writev(int blocknum, int n, const char *data[]) {
+    defrag_stats.writes += n;
+    defrag_stats.write_requests++;
+    if (!defrag_dry) disk_writev(blocknum, n, data);
+    return;
+}
 
+// move data so that blocks data_start..next-1 get their new contents. source[t] is where the data for block t
+// is now, target[b] where the data now in block b has to go, -1 if nowhere.
+// blocks below the window are final, so the data for a window always lies at or past it. the window is read
+// whole, its new contents are gathered from that copy and from runs outside, and written in one sequential
+// request. data of the window that belongs further on goes to the blocks outside the window just read, which
+// are free now
+int relayout_move(int *source, int *target, int next) {
+    char *window = (char*) aligned_alloc(DISK_BLOCK_SIZE, (size_t) DEFRAG_WINDOW * DISK_BLOCK_SIZE);
+    char *staging = (char*) aligned_alloc(DISK_BLOCK_SIZE, (size_t) DEFRAG_WINDOW * DISK_BLOCK_SIZE);
+    int *vacated = (int*) malloc(DEFRAG_WINDOW * sizeof(int));
+    const char **displaced = (const char**) malloc(DEFRAG_WINDOW * sizeof(char*));
+    if (!window || !staging || !vacated || !displaced) {
+        fprintf(stderr, "couldn't create staging buffer: %s\n", strerror(errno));
+        free(window);
+        free(staging);
+        free(vacated);
+        free(displaced);
+        return 0;
     }
-    disk_read(curr.indirect, pointer_block.data);
-    
-    // indirect pointer block sttart from 0
-    p -= POINTERS_PER_INODE;
 
-    // write block pointed by the pointers in the pointer block
-    while (length && p < POINTERS_PER_BLOCK) {
-        // get data block
-        union fs_block block;
+    for (int t = data_start; t < next; ) {
+        if (source[t] == t) {
+            t++;
+            continue;
+        }
 
-        if (!pointer_block.pointers[p]) {
-            int new_block_num = get_block();
+        // window from the first misplaced block to the last one within reach
+        int k = next - t < DEFRAG_WINDOW ? next - t : DEFRAG_WINDOW;
+        while (source[t + k - 1] == t + k - 1) k--;
 
-            // disk is full
-            if (!new_block_num) {
-                wrap_up_write(inumber, offset, write_data, &curr);
-                return write_data;
-            } 
+        defrag_read(t, k, window);
 
-            // change belong map
-            memset(&belong[new_block_num], 0, sizeof(struct fs_belong));
-            belong[new_block_num].inode = inumber;
-            belong[new_block_num].indirect_block = p+1;
+        // new contents. runs of neighbouring sources outside the window are read with one request
+        int nvacated = 0;
+        for (int w = t; w < t + k; ) {
+            int from = source[w];
+            if (from < t + k) {
+                memcpy(staging + (size_t) (w - t) * DISK_BLOCK_SIZE, window + (size_t) (from - t) * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+                w++;
+                continue;
+            }
 
-            // write back change in indirect block
-            pointer_block.pointers[p] = new_block_num;
-            disk_write(curr.indirect, pointer_block.data);
+            int n = 1;
+            while (w + n < t + k && source[w + n] == from + n) n++;
+            defrag_read(from, n, staging + (size_t) (w - t) * DISK_BLOCK_SIZE);
+            for (int i = 0; i < n; ++i) {
+                vacated[nvacated++] = from + i;
+                target[from + i] = -1;
+            }
+            w += n;
+        }
+        defrag_write(t, k, staging);
+
+        // there are at least as many vacated blocks as blocks of data the window pushed out
+        int ndisplaced = 0;
+        for (int w = t; w < t + k; ++w) {
+            int to = target[w];
+            if (to >= t + k) {
+                int v = vacated[ndisplaced];
+                displaced[ndisplaced++] = window + (size_t) (w - t) * DISK_BLOCK_SIZE;
+                target[v] = to;
+                source[to] = v;
+            }
+        }
+        for (int w = t; w < t + k; ++w) {
+            target[w] = w;
+            source[w] = w;
+        }
 
+        for (int i = 0; i < ndisplaced; ) {
+            int n = 1;
+            while (i + n < ndisplaced && vacated[i + n] == vacated[i] + n) n++;
+            defrag_writev(vacated[i], n, displaced + i);
+            i += n;
         }
-        disk_read(pointer_block.pointers[p], block.data);
+        t += k;
+    }
 
-        int to_write;
-        if (offset_p + length > DISK_BLOCK_SIZE) to_write = DISK_BLOCK_SIZE - offset_p;
-        else to_write = length - offset_p;
+    free(window);
+    free(staging);
+    free(vacated);
+    free(displaced);
+    return 1;
+}
 
-        // copy data
-        memcpy(block.data+offset_p, data+write_data, to_write);
+// lay the disk out again so every file is contiguous, in inode order from the first data block. the new
+// place of each block follows from its owner, see owner_of. extent files become a single extent, block mapped
+// files keep each pointer block in front of the blocks it maps. a dry run stops after counting the moves
+int relayout(int dry) {
+    relayout_dest = (int*) calloc(nblocks, sizeof(int));
+    int *source = (int*) calloc(nblocks, sizeof(int));
+    int *target = (int*) malloc(nblocks * sizeof(int));
+    int *count = (int*) calloc(ninodes, sizeof(int));
+    int *start = (int*) calloc(ninodes + 1, sizeof(int));
+    if (!relayout_dest || !source || !target || !count || !start) {
+        fprintf(stderr, "couldn't create block map: %s\n", strerror(errno));
+        free(relayout_dest);
+        free(source);
+        free(target);
+        free(count);
+        free(start);
+        relayout_dest = NULL;
+        return 0;
+    }
 
-        // write back
-        disk_write(pointer_block.pointers[p], block.data);
+    // blocks each inode keeps, and where its blocks start in the new layout
+    for (int b = data_start; b < nblocks; ++b) {
+        if (!bitmap_test(bitmap, b)) continue;
+        struct fs_belong owner = owner_of(b);
+        if (owner.inode && owner.index >= 0) count[owner.inode]++;
+    }
+    start[1] = data_start;
+    for (int i = 1; i < ninodes; ++i) start[i + 1] = start[i] + count[i];
+    int next = start[ninodes];
+
+    // the permutation from old to new places
+    memset(&defrag_stats, 0, sizeof(struct fs_defrag_stats));
+    for (int b = 0; b < nblocks; ++b) {
+        target[b] = -1;
+        if (b < data_start || !bitmap_test(bitmap, b)) continue;
+        struct fs_belong owner = owner_of(b);
+        if (!owner.inode || owner.index < 0) continue;
+
+        int t = start[owner.inode] + owner.index;
+        relayout_dest[b] = t;
+        target[b] = t;
+        source[t] = b;
+        if (t != b) defrag_stats.moved++;
+    }
 
-        write_data += to_write;
-        offset_p = 0;
-        length -= to_write;
-        p++;
+    defrag_dry = dry;
+    int moved = relayout_move(source, target, next);
+    defrag_dry = 0;
+
+    free(source);
+    free(target);
+    free(start);
+    if (!moved || dry) {
+        free(relayout_dest);
+        free(count);
+        relayout_dest = NULL;
+        return moved;
     }
 
-    wrap_up_write(inumber, offset, write_data, &curr);
-    return write_data;
+    // point the metadata at the new places
+    for (int i = 1; i < ninodes; ++i) {
+        struct fs_inode curr;
+        inode_load(i, &curr);
+        if (!curr.isvalid || (curr.flags & FS_INODE_INLINE)) continue;
+
+        if (curr.flags & FS_INODE_EXTENTS) {
+            // one extent, no overflow block
+            curr.extent[0].start = count[i] ? relayout_dest[curr.extent[0].start] : 0;
+            curr.extent[0].length = count[i];
+            curr.nextents = count[i] ? 1 : 0;
+            curr.overflow = 0;
+        } else {
+            for (int k = 0; k < POINTERS_PER_INODE; ++k) {
+                if (curr.direct[k]) curr.direct[k] = relayout_dest[curr.direct[k]];
+            }
+
+            int *roots[] = {&curr.indirect, &curr.dindirect, &curr.tindirect};
+            for (int l = 0; l < POINTER_LEVELS; ++l) {
+                if (!*roots[l]) continue;
+                *roots[l] = relayout_dest[*roots[l]];
+                relayout_update_tree(*roots[l], l + 1);
+            }
+        }
+        inode_save(i, &curr);
+    }
+
+    // data region is now in use up to next. the rest is discarded once the new maps are on the image
+    disk_flush();
+    if (next < nblocks) disk_discard(next, nblocks - next);
+    for (int b = data_start; b < nblocks; ++b) bitmap_set(b, b < next);
+    alloc_reset(next);
+
+    free(relayout_dest);
+    free(count);
+    relayout_dest = NULL;
+    return 1;
 }
 
-// swap the content of 2 data block
-void swap(int *blocknum_a, int *blocknum_b, int a_inumber, struct fs_inode *anode, union fs_block *a_indirect, int a_indirect_pointer) {
-    // no need to swap
-    if (*blocknum_a == *blocknum_b) {
-        (*blocknum_b)++;
-        return;
+// whether the reverse map gives every block in use its place in a relayout. a block mapped file with holes
+// leaves gaps between the places of its blocks, and then only a scan can tell them
+int rmap_dense() {
+    int *count = (int*) calloc(ninodes, sizeof(int));
+    int *top = (int*) calloc(ninodes, sizeof(int));
+    int dense = count && top;
+
+    for (int b = data_start; dense && b < nblocks; ++b) {
+        if (!bitmap_test(bitmap, b)) continue;
+
+        struct fs_belong owner = rmap_get(b);
+        if (owner.inode <= 0 || owner.inode >= ninodes) {
+            fprintf(stderr, "reverse map has no owner for block %d\n", b);
+            dense = 0;
+        } else if (owner.index >= 0) {
+            count[owner.inode]++;
+            if (owner.index >= top[owner.inode]) top[owner.inode] = owner.index + 1;
+        }
+    }
+    for (int i = 1; dense && i < ninodes; ++i) {
+        if (count[i] != top[i]) dense = 0;
     }
 
-    // read in block a
-    union fs_block block_a;
-    disk_read(*blocknum_a, block_a.data);
+    free(count);
+    free(top);
+    return dense;
+}
 
-    // b is not in use
-    if (!bitmap[*blocknum_b]) {
-        disk_write(*blocknum_b, block_a.data);
-        bitmap[*blocknum_a] = 0;
-        bitmap[*blocknum_b] = 1;
-        belong[*blocknum_b] = belong[*blocknum_a];
-        *blocknum_a = (*blocknum_b)++;
+// work out the new layout and carry it out, or only count its cost in a dry run. owners come from the
+// reverse map when it has them all, from a fresh belong map otherwise
+int defrag_plan(int dry) {
+    if (nrmapblocks && rmap_dense()) return relayout(dry);
 
-        return;
+    uint64_t *scanned = bitmap_alloc();
+    belong = (struct fs_belong*) calloc(nblocks, sizeof(struct fs_belong));
+    if (!scanned || !belong) {
+        fprintf(stderr, "couldn't create belong map: %s\n", strerror(errno));
+        free(scanned);
+        free(belong);
+        belong = NULL;
+        return 0;
     }
 
-    // b is in use, load block b
-    union fs_block block_b;
-    disk_read(*blocknum_b, block_b.data);
+    int ok = scan_blocks(scanned, belong, NULL) && relayout(dry);
 
-    int b_inumber = belong[*blocknum_b].inode;
+    free(scanned);
+    free(belong);
+    belong = NULL;
+    return ok;
+}
 
-    // load b inode
-    struct fs_inode bnode;
-    if (a_inumber == b_inumber) bnode = *anode;
-    else inode_load(b_inumber, &bnode);
+// rearrange inodes to start from the first inode of their block group, so every group keeps its own files
+void rearrange_inode() {
+    for (int k = 0; k < ngroups; ++k) {
+        int idx = groups[k].inode_start;
 
+        // check inode
+        for (int i = groups[k].inode_start; i < groups[k].inode_end; ++i) {
+            // load inode
+            struct fs_inode curr;
+            inode_load(i, &curr);
 
-    if (belong[*blocknum_b].direct_pointer) {
-        bnode.direct[belong[*blocknum_b].direct_pointer-1] = *blocknum_a;
-    } else if (belong[*blocknum_b].indirect_pointer) {
-        bnode.indirect = *blocknum_a;
-    } else {
-        // change the pointer for b in the indirect block
+            // not valid
+            if (!curr.isvalid) continue;
 
-        // we work on the same node and working with indirect pointer
-        if (a_inumber == b_inumber && (a_indirect_pointer || a_indirect)) {
+            if (idx == i) { // don't need to do anything
+                idx++;
+                continue;
+            }
 
-            // working a's indirect pointer, need to change content of the indirect block
-            if (a_indirect_pointer) block_a.pointers[belong[*blocknum_b].indirect_block-1] = *blocknum_a;
+            struct fs_inode dest;
+            inode_load(idx, &dest);
 
-            // 2 data block from indirect pointer block
-            if (a_indirect) (*a_indirect).pointers[belong[*blocknum_b].indirect_block-1] = *blocknum_a;
+            // swap content
+            struct fs_inode buffer;
+            memcpy(&buffer, &curr, sizeof(struct fs_inode));
+            memcpy(&curr, &dest, sizeof(struct fs_inode));
+            memcpy(&dest, &buffer, sizeof(struct fs_inode));
 
+            // save back
+            inode_save(i, &curr);
+            inode_save(idx++, &dest);
         }
-        else {
-            union fs_block block_b_indirect;
-            disk_read(bnode.indirect, block_b_indirect.data);
+    }
+    return;
+}
 
-            block_b_indirect.pointers[belong[*blocknum_b].indirect_block-1] = *blocknum_a;
+// defrag the disk
+void defrag_all() {
+    if (!mounted) {
+        fprintf(stderr, "file system not mounted yet\n");
+        return;
+    }
 
-            // write back change
-            disk_write(bnode.indirect, block_b_indirect.data);
+    // blocks and inodes are about to move under any open file
+    for (int i = 0; i < FS_MAX_OPEN; ++i) {
+        if (open_files[i].inumber) {
+            fprintf(stderr, "cannot defrag: inode %d is open\n", open_files[i].inumber);
+            return;
         }
     }
 
-    // swap content
-    disk_write(*blocknum_b, block_a.data);
-    disk_write(*blocknum_a, block_b.data);
+    // inodes are renumbered and files move. delayed writes need their blocks first
+    sync_delays();
+    stream_drop(0);
+    memset(&defrag_move, 0, sizeof(struct fs_defrag_move));
+    defrag_cursor = 1;
 
-    // swap belong for a and b
-    struct fs_belong tmp;
-    tmp = belong[*blocknum_a];
-    belong[*blocknum_a] = belong[*blocknum_b];
-    belong[*blocknum_b] = tmp;
+    if (!defrag_plan(0)) return;
 
-    // save back b inode
-    
-    if (a_inumber == b_inumber) *anode = bnode;
-    else inode_save(b_inumber, &bnode);
+    // put inodes to the initial inodes
+    rearrange_inode();
+    bitmap_sync();
 
-    // change the pointer value of a
-    *blocknum_a = (*blocknum_b)++;
+    // every block has a new place and many a new owner
+    rmap_rebuild();
 
+    // inodes were moved, rebuild the inode map when next needed
+    free(inode_map);
+    inode_map = NULL;
     return;
 }
 
-// rearrange data block of each inode so they are continuous on disk
-void rearrange_datablock() {
-    union fs_block block;
+void fs_defrag() {
+    pthread_rwlock_wrlock(&fs_lock);
+    defrag_all();
+    pthread_rwlock_unlock(&fs_lock);
+    return;
+}
 
-    // superblock information
-    disk_read(0, block.data);
+// cost of a defrag in data moves, without touching the disk. data still in delayed write buffers is not counted
+int defrag_plan_stats(struct fs_defrag_stats *stats) {
+    if (!mounted) {
+        fprintf(stderr, "file system not mounted yet\n");
+        return 0;
+    }
 
-    // check each inode block
-    int ninodeblocks = block.super.ninodeblocks;
+    if (!defrag_plan(1)) return 0;
+    *stats = defrag_stats;
+    return 1;
+}
 
-    // starting block number of data block
-    int idx = ninodeblocks + 1;
+int fs_defrag_plan(struct fs_defrag_stats *stats) {
+    pthread_rwlock_wrlock(&fs_lock);
+    int ok = defrag_plan_stats(stats);
+    pthread_rwlock_unlock(&fs_lock);
+    return ok;
+}
 
-    // check inode
-    for (int i = 1; i < block.super.ninodes; ++i) {
-        // load inode
-        struct fs_inode curr;
-        inode_load(i, &curr);
+// start moving inode inumber if its data is in more than one run and a free run can hold all of it
+int defrag_begin(int inumber) {
+    int fd = file_open_locked(inumber);
+    if (fd < 0) return 0;
+    struct fs_file *f = &open_files[fd];
 
-        // not valid
-        if (!curr.isvalid) continue;
+    // inline files have no blocks to move
+    if (f->inode.flags & FS_INODE_INLINE) {
+        file_close_locked(fd);
+        return 0;
+    }
 
-        // check each direct pointer
-        for (int j = 0; j < POINTERS_PER_INODE; ++j) {
-            if (curr.direct[j]) swap(&curr.direct[j], &idx, i, &curr, NULL, 0);
+    // data blocks and runs of them
+    int count = 0, runs = 0;
+    if (f->inode.flags & FS_INODE_EXTENTS) {
+        count = file_extent_blocks(f);
+        runs = f->inode.nextents;
+    } else {
+        int64_t size = (f->inode.size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+        for (int64_t p = 0; p < size; ) {
+            int blocknum;
+            int run = file_run(f, p, size - p < MAX_IO_BLOCKS ? size - p : MAX_IO_BLOCKS, &blocknum);
+            if (blocknum) {
+                count += run;
+                runs++;
+            }
+            p += run;
         }
+    }
+    file_close_locked(fd);
+    if (runs < 2) return 0;
+
+    // the shortest free run that holds the file is found now but left free. the cursor of its group moves
+    // past it, so new files are put elsewhere
+    int start;
+    if (!find_best_fit(count, &start)) return 0;
+
+    struct fs_group *g = group_of(start);
+    if (g->cursor >= start && g->cursor < start + count) g->cursor = start + count < g->end ? start + count : g->start;
+
+    defrag_move.inumber = inumber;
+    defrag_move.start = start;
+    defrag_move.count = count;
+    defrag_move.done = 0;
+    defrag_move.next = 0;
+    return 1;
+}
 
-        if (curr.indirect) {
-            // swap indirect block
-            swap(&curr.indirect, &idx, i, &curr, NULL, 1);
+// map file blocks 0..done-1 of an extent file to the run at start, keeping the extents after them.
+// only count the extents that gives if apply is 0. return the number of extents
+int defrag_remap_extents(struct fs_file *f, int start, int done, int apply) {
+    // the moved run comes in front of what is left of every extent, one more than a full map holds
+    struct fs_extent remap[MAX_EXTENTS + 1];
+    int n = 0, p = 0;
+
+    remap[n++] = (struct fs_extent) {start, done};
+    for (int k = 0; k < f->inode.nextents; ++k) {
+        struct fs_extent e = *file_extent(f, k);
+        int skip = done > p ? done - p : 0;
+        p += e.length;
+        if (skip >= e.length) continue;
+
+        e.start += skip;
+        e.length -= skip;
+        if (n == 1 && start + done == e.start) remap[0].length += e.length;
+        else remap[n++] = e;
+    }
+    if (!apply) return n;
+
+    for (int k = 0; k < n; ++k) *file_extent(f, k) = remap[k];
+    f->inode.nextents = n;
+    f->inode_dirty = 1;
+    if (n > INODE_EXTENTS) f->map_dirty = 1;
+
+    // overflow block is not needed any more. the caller frees it with the old blocks
+    if (n <= INODE_EXTENTS && f->inode.overflow) {
+        f->inode.overflow = 0;
+        f->map_loaded = 0;
+        f->map_dirty = 0;
+    }
+    return n;
+}
 
-            // read in pointer block
-            union fs_block pointer_block;
-            disk_read(curr.indirect, pointer_block.data);
+// copy the next blocks of the file being moved into its run, at most budget blocks of I/O.
+// the file maps the copied blocks at their new place and the old ones are free before this returns.
+// return the blocks of I/O used
+int defrag_copy(char *staging, int budget) {
+    int fd = file_open_locked(defrag_move.inumber);
+    if (fd < 0) {
+        memset(&defrag_move, 0, sizeof(struct fs_defrag_move));
+        return 0;
+    }
+    struct fs_file *f = &open_files[fd];
+    int extents = f->inode.flags & FS_INODE_EXTENTS;
+
+    // every block is read once and written once
+    int n = defrag_move.count - defrag_move.done;
+    if (n > budget / 2) n = budget / 2;
+    if (n > MAX_IO_BLOCKS) n = MAX_IO_BLOCKS;
+
+    // the run is not held between steps, stop where something else took it
+    int to = defrag_move.start + defrag_move.done;
+    for (int k = 0; k < n; ++k) {
+        if (bitmap_test(bitmap, to + k)) {
+            n = k;
+            break;
+        }
+    }
 
-            for (int k = 0; k < POINTERS_PER_BLOCK; ++k) {
-                if (pointer_block.pointers[k]) swap(&pointer_block.pointers[k], &idx, i, &curr, &pointer_block, 0);
+    // splitting the first extent adds one. leave the file alone if the inode has no room for it
+    int room = f->inode.overflow ? MAX_EXTENTS : INODE_EXTENTS;
+    if (extents && n && defrag_remap_extents(f, defrag_move.start, defrag_move.done + n, 0) > room) n = 0;
+
+    // the next n data blocks of the file, read in runs
+    int old[MAX_IO_BLOCKS], logical[MAX_IO_BLOCKS];
+    int got = 0;
+    int64_t size = (f->inode.size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    int64_t p = extents ? defrag_move.done : defrag_move.next;
+    while (got < n && p < size) {
+        int blocknum;
+        int run = file_run(f, p, n - got, &blocknum);
+        if (blocknum) {
+            disk_read_blocks(blocknum, run, staging + (size_t) got * DISK_BLOCK_SIZE);
+            for (int i = 0; i < run; ++i) {
+                old[got + i] = blocknum + i;
+                logical[got + i] = p + i;
             }
+            got += run;
+        }
+        p += run;
+    }
 
-            // write back indirect block
-            disk_write(curr.indirect, pointer_block.data);   
+    if (got) {
+        disk_write_blocks(to, got, staging);
+        for (int i = 0; i < got; ++i) {
+            bitmap_set(to + i, 1);
+            rmap_set(to + i, f->inumber, extents ? logical[i] : layout_key(logical[i], 0));
         }
 
-        // save back
-        inode_save(i, &curr);
+        // point the file at the copies, then let the old blocks go. they are punched and given away only once
+        // the new map is on the image, so a crash never leaves the file mapped to them
+        int overflow = f->inode.overflow;
+        if (extents) {
+            defrag_remap_extents(f, defrag_move.start, defrag_move.done + got, 1);
+        } else {
+            // the blocks were just read through their slots, so no pointer block is missing
+            for (int i = 0; i < got; ++i) *file_slot(f, logical[i], NULL, 0, 1) = to + i;
+        }
+        file_sync(f);
+        disk_flush();
+
+        struct fs_release release = {0, 0};
+        for (int i = 0; i < got; ++i) release_block(&release, old[i]);
+        if (overflow && !f->inode.overflow) release_block(&release, overflow);
+        release_flush(&release);
+        bitmap_sync();
+
+        defrag_move.done += got;
+        defrag_move.next = logical[got - 1] + 1;
+        defrag_blocks += got;
     }
-    return;
+
+    // finished, or the run or the file ran out
+    if (defrag_move.done == defrag_move.count) defrag_files++;
+    if (defrag_move.done == defrag_move.count || got < n || !n) memset(&defrag_move, 0, sizeof(struct fs_defrag_move));
+
+    file_close_locked(fd);
+    return 2 * got;
 }
 
-// rearrange inode to start from inode 1
-void rearrange_inode() {
-    int idx = 1;
+// do a bounded piece of defragmentation: files are made contiguous one by one, going around the inode table
+// from a cursor that is kept across steps and unmounts. budget is the number of blocks that may be read and
+// written. the disk is consistent after every step, and files may be read and written between steps.
+// return the blocks of I/O used, 0 if there was nothing to do, -1 on error
+int defrag_step(int budget) {
+    if (!mounted) {
+        fprintf(stderr, "file system not mounted yet\n");
+        return -1;
+    }
 
-    // check inode
-    for (int i = 1; i < ninodes; ++i) {
-        // load inode
-        struct fs_inode curr;
-        inode_load(i, &curr);
+    if (!inode_map && !inode_map_build()) return -1;
+
+    char *staging = (char*) aligned_alloc(DISK_BLOCK_SIZE, (size_t) MAX_IO_BLOCKS * DISK_BLOCK_SIZE);
+    if (!staging) {
+        fprintf(stderr, "couldn't create staging buffer: %s\n", strerror(errno));
+        return -1;
+    }
 
-        // not valid
-        if (!curr.isvalid) continue;
+    // at most one trip around the inode table per step
+    int used = 0, visited = 0;
+    while (budget - used >= 2) {
+        if (!defrag_move.inumber) {
+            if (visited++ >= ninodes) break;
 
-        if (idx == i) { // don't need to do anything
-            idx++;
-            continue;
+            int i = defrag_cursor;
+            if (++defrag_cursor >= ninodes) {
+                defrag_cursor = 1;
+                defrag_passes++;
+            }
+            if (!bitmap_test(inode_map, i) || !defrag_begin(i)) continue;
         }
+        used += defrag_copy(staging, budget - used);
+    }
 
-        struct fs_inode dest;
-        inode_load(idx, &dest);
+    bitmap_sync();
+    free(staging);
+    return used;
+}
 
-        // swap content
-        struct fs_inode buffer;
-        memcpy(&buffer, &curr, sizeof(struct fs_inode));
-        memcpy(&curr, &dest, sizeof(struct fs_inode));
-        memcpy(&dest, &buffer, sizeof(struct fs_inode));
+int fs_defrag_step(int budget) {
+    pthread_rwlock_wrlock(&fs_lock);
+    int used = defrag_step(budget);
+    pthread_rwlock_unlock(&fs_lock);
+    return used;
+}
 
-        // save back
-        inode_save(i, &curr);
-        inode_save(idx++, &dest);
-    }
+void fs_defrag_progress(struct fs_defrag_progress *progress) {
+    pthread_rwlock_rdlock(&fs_lock);
+    progress->cursor = defrag_cursor;
+    progress->ninodes = ninodes;
+    progress->passes = defrag_passes;
+    progress->moving = defrag_move.inumber;
+    progress->files = defrag_files;
+    progress->blocks = defrag_blocks;
+    pthread_rwlock_unlock(&fs_lock);
     return;
 }
 
-// defrag the disk
-void fs_defrag() {
+// layout statistics of the mounted disk, from the owners of the blocks and the bitmap. per-file counts go to
+// stats->file, one entry per inode, which the caller frees. owners come from the reverse map, or from a fresh
+// belong map on disks without one
+int fragstat(struct fs_fragstat *stats) {
     if (!mounted) {
         fprintf(stderr, "file system not mounted yet\n");
-        return;
+        return 0;
     }
 
-    // first rearrange datablock
-    rearrange_datablock();
+    // data in delayed write buffers has no blocks yet. it is counted apart, and left where it is
+    memset(stats, 0, sizeof(struct fs_fragstat));
+    for (int i = 0; i < DELAY_FILES; ++i) {
+        if (!delays[i].inumber) continue;
+        stats->delayed_files++;
+        stats->delayed_blocks += delays[i].nblocks;
+    }
+    uint64_t *scanned = NULL;
+    if (!nrmapblocks) {
+        scanned = bitmap_alloc();
+        belong = (struct fs_belong*) calloc(nblocks, sizeof(struct fs_belong));
+    }
+    int *first = (int*) calloc(ninodes, sizeof(int));
+    int *last = (int*) calloc(ninodes, sizeof(int));
+    int *top = (int*) calloc(ninodes, sizeof(int));
+    stats->file = (struct fs_fragstat_file*) calloc(ninodes, sizeof(struct fs_fragstat_file));
+    if ((!nrmapblocks && (!scanned || !belong)) || !first || !last || !top || !stats->file) {
+        fprintf(stderr, "couldn't create belong map: %s\n", strerror(errno));
+        free(scanned);
+        free(belong);
+        free(first);
+        free(last);
+        free(top);
+        free(stats->file);
+        belong = NULL;
+        stats->file = NULL;
+        return 0;
+    }
 
-    // put inodes to the initial inodes
-    rearrange_inode();
+    int ok = nrmapblocks || scan_blocks(scanned, belong, NULL);
+    stats->ninodes = ninodes;
+
+    // a file's blocks form one extent as long as each comes right after the one before it in its layout
+    struct fs_belong before = {0, 0};
+    for (int b = data_start; ok && b < nblocks; ++b) {
+        if (!bitmap_test(bitmap, b)) {
+            // free run starting here
+            int run = 1;
+            while (b + run < nblocks && !bitmap_test(bitmap, b + run)) run++;
+            int k = 0;
+            while (k < FS_FRAG_BUCKETS - 1 && run >> (k + 1)) k++;
+            stats->free_runs[k]++;
+            stats->nfree_runs++;
+            stats->free_blocks += run;
+            if (run > stats->free_run_max) stats->free_run_max = run;
+            b += run - 1;
+            before.inode = 0;
+            continue;
+        }
 
-    return;
+        struct fs_belong owner = owner_of(b);
+        int i = owner.inode;
+        int after = before.inode == i && before.index == owner.index - 1;
+        before = owner;
+        if (i <= 0 || i >= ninodes || owner.index < 0) continue;
+
+        struct fs_fragstat_file *file = &stats->file[i];
+        if (!after) file->extents++;
+        file->blocks++;
+        if (owner.index == 0) first[i] = b;
+        if (!last[i] || owner.index > top[i]) {
+            last[i] = b;
+            top[i] = owner.index;
+        }
+    }
+
+    // reading every file start to end in inode order seeks once per extent, except into a file that starts
+    // right where the one before it ended
+    int prev = 0;
+    for (int i = 1; ok && i < ninodes; ++i) {
+        struct fs_fragstat_file *file = &stats->file[i];
+        if (!file->blocks) continue;
+
+        stats->files++;
+        stats->blocks += file->blocks;
+        stats->extents += file->extents;
+        if (file->extents > 1) stats->fragmented++;
+        if (file->extents > stats->max_extents) stats->max_extents = file->extents;
+        stats->seeks += file->extents;
+        if (prev && first[i] == prev + 1) stats->seeks--;
+        prev = last[i];
+    }
+
+    free(scanned);
+    free(belong);
+    free(first);
+    free(last);
+    free(top);
+    belong = NULL;
+    if (!ok) {
+        free(stats->file);
+        stats->file = NULL;
+    }
+    return ok;
+}
+
+int fs_fragstat(struct fs_fragstat *stats) {
+    pthread_rwlock_wrlock(&fs_lock);
+    int ok = fragstat(stats);
+    pthread_rwlock_unlock(&fs_lock);
+    return ok;
+}
+
+// free run of group g found by one of the free_ queries, 0 if a is none
+int free_found(struct fs_group *g, int a, int *length) {
+    *length = a ? g->index[a].length : 0;
+    return a ? g->index[a].start : 0;
+}
+
+int fs_free_longest(int *length) {
+    pthread_rwlock_rdlock(&fs_lock);
+    int start = 0;
+    *length = 0;
+    for (int k = 0; mounted && k < ngroups; ++k) {
+        struct fs_group *g = &groups[k];
+        pthread_mutex_lock(&g->lock);
+        int len, b = free_found(g, free_longest(g), &len);
+        if (len > *length) {
+            start = b;
+            *length = len;
+        }
+        pthread_mutex_unlock(&g->lock);
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    return start;
+}
+
+int fs_free_best(int n, int *length) {
+    pthread_rwlock_rdlock(&fs_lock);
+    int start = 0;
+    *length = mounted && n > 0 ? find_best_fit(n, &start) : 0;
+    pthread_rwlock_unlock(&fs_lock);
+    return start;
+}
+
+// the rest of the run holding blocknum, else the first long enough run after it, on to the following groups and
+// around to the start of the disk
+int fs_free_near(int blocknum, int n, int *length) {
+    pthread_rwlock_rdlock(&fs_lock);
+    int start = 0;
+    *length = 0;
+    if (mounted && n > 0 && blocknum >= data_start && blocknum < nblocks) {
+        int first = group_of(blocknum) - groups;
+        for (int k = 0; k <= ngroups && !start; ++k) {
+            struct fs_group *g = &groups[(first + k) % ngroups];
+            int from = k == 0 ? blocknum : g->start;
+            int to = k == ngroups ? blocknum : g->end;
+
+            pthread_mutex_lock(&g->lock);
+            int a = k == 0 ? free_at(g, blocknum) : 0;
+            if (a && g->index[a].start + g->index[a].length - blocknum >= n) {
+                start = blocknum;
+                *length = g->index[a].start + g->index[a].length - blocknum;
+            } else {
+                start = free_found(g, free_next(g, g->root[FREE_BY_START], from, n), length);
+                if (start >= to) start = *length = 0;
+            }
+            pthread_mutex_unlock(&g->lock);
+        }
+    }
+    pthread_rwlock_unlock(&fs_lock);
+    return start;
 }
@@ -1,16 +1,105 @@
 #ifndef FS_H
 #define FS_H
 
+#include <stdint.h>
+
+// inode formats for fs_format
+#define FS_FORMAT_CLASSIC  0    // 32-byte inodes with direct and indirect pointers
+#define FS_FORMAT_EXTENT   1    // 128-byte inodes mapping files by extents
+#define FS_FORMAT_INDIRECT 2    // 128-byte inodes with direct, indirect, double and triple indirect pointers
+#define FS_FORMAT_DISCARD  0x100    // or'ed into the format: punch the old contents out of the image
+
 void fs_debug();
-int  fs_format();
-int  fs_mount();
+int  fs_format( int version );
+int  fs_mount( int cache_blocks );
+int  fs_unmount();
+int  fs_check();
+int  fs_sync();
+void fs_scan_threads( int n );
+int  fs_mark_unclean();
 
 int  fs_create();
 int  fs_delete( int inumber );
-int  fs_getsize();
+int64_t fs_getsize( int inumber );
 
-int  fs_read( int inumber, char *data, int length, int offset );
-int  fs_write( int inumber, const char *data, int length, int offset );
+int  fs_read( int inumber, char *data, int length, int64_t offset );
+int  fs_write( int inumber, const char *data, int length, int64_t offset );
+
+int  fs_open( int inumber );
+int  fs_close( int fd );
+int  fs_pread( int fd, char *data, int length, int64_t offset );
+int  fs_pwrite( int fd, const char *data, int length, int64_t offset );
 
 void fs_defrag();
+
+// data moves of a defrag, as counted by fs_defrag_plan
+struct fs_defrag_stats {
+    int moved;              // blocks that change place
+    int64_t reads;          // blocks read
+    int64_t read_requests;
+    int64_t writes;         // blocks written
+    int64_t write_requests;
+};
+
+int  fs_defrag_plan( struct fs_defrag_stats *stats );
+
+// progress of incremental defrag since mount
+struct fs_defrag_progress {
+    int cursor;             // next inode fs_defrag_step looks at
+    int ninodes;
+    int passes;             // times the cursor went around the inode table
+    int moving;             // inode being moved, 0 if none
+    int64_t files;          // files made contiguous
+    int64_t blocks;         // blocks moved
+};
+
+int  fs_defrag_step( int budget );
+void fs_defrag_progress( struct fs_defrag_progress *progress );
+
+// layout of the mounted disk, from fs_fragstat. an extent is a run of blocks of one file that are next to
+// each other on disk and in the file. pointer blocks count as part of the file they map
+#define FS_FRAG_BUCKETS 16
+
+struct fs_fragstat_file {
+    int blocks;
+    int extents;            // 0 for a file without blocks
+};
+
+struct fs_fragstat {
+    int ninodes;
+    int files;              // files with blocks
+    int fragmented;         // files in more than one extent
+    int max_extents;
+    int64_t blocks;         // blocks of all files
+    int64_t extents;        // extents of all files
+    int64_t seeks;          // estimated seeks to read every file in inode order
+    int64_t free_blocks;    // free blocks in the data region
+    int nfree_runs;
+    int free_run_max;
+    int free_runs[FS_FRAG_BUCKETS]; // free runs of 1, 2-3, 4-7, ... blocks, the last bucket takes every longer run
+    int delayed_files;      // files with data in delayed write buffers
+    int64_t delayed_blocks; // blocks of that data, which has no blocks on disk yet and is not counted above
+    struct fs_fragstat_file *file;  // ninodes entries, to be freed by the caller
+};
+
+int  fs_fragstat( struct fs_fragstat *stats );
+
+// free space index queries. each returns the first block of a free run and stores its length in *length,
+// 0 if there is no such run
+int  fs_free_longest( int *length );
+int  fs_free_best( int n, int *length );                  // shortest run of at least n blocks
+int  fs_free_near( int blocknum, int n, int *length );    // first run of at least n blocks from blocknum on
+
+// readahead counters since mount
+struct fs_readahead_stats {
+    int streams;            // inodes being read sequentially
+    int window_total;       // sum of their readahead windows, in blocks
+    int window_max;         // largest of their windows
+    int window_limit;       // largest window the block cache allows, 0 if readahead is off
+    int64_t fills;          // readahead requests
+    int64_t blocks;         // blocks read ahead
+    int64_t hits;           // blocks read ahead that a read used
+};
+
+void fs_readahead_stats( struct fs_readahead_stats *stats );
 #endif
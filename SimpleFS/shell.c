@@ -1,14 +1,21 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "bench.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 
+#define DEFAULT_CACHE_BLOCKS 256
+
+static int disk_mode( const char *name );
+static int format_version( const char *name );
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
+static void do_readahead();
+static int do_fragstat( int machine );
 
 int main( int argc, char *argv[] )
 {
@@ -17,13 +24,15 @@ int main( int argc, char *argv[] )
 	char arg1[1024];
 	char arg2[1024];
 	int inumber, result, args;
+	int64_t size;
+	int mounted=0;
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	if(argc!=3 && !(argc==4 && disk_mode(argv[3])>=0)) {
+		printf("use: %s <diskfile> <nblocks> [pread|mmap|uring|direct]\n",argv[0]);
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
+	if(!disk_init(argv[1],atoi(argv[2]),argc==4 ? disk_mode(argv[3]) : DISK_PREAD)) {
 		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
 		return 1;
 	}
@@ -43,24 +52,59 @@ int main( int argc, char *argv[] )
 		if(args==0) continue;
 
 		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
+			int discard = args>1 && !strcmp(args==3 ? arg2 : arg1,"discard");
+			int version = args-discard==2 ? format_version(arg1) : FS_FORMAT_CLASSIC;
+			if(args-discard<=2 && version>=0) {
+				if(fs_format(discard ? version|FS_FORMAT_DISCARD : version)) {
 					printf("disk formatted.\n");
 				} else {
 					printf("format failed!\n");
 				}
 			} else {
-				printf("use: format\n");
+				printf("use: format [extent|indirect|classic] [discard]\n");
 			}
 		} else if(!strcmp(cmd,"mount")) {
-			if(args==1) {
-				if(fs_mount()) {
+			if(args==1 || args==2) {
+				if(fs_mount(args==2 ? atoi(arg1) : DEFAULT_CACHE_BLOCKS)) {
 					printf("disk mounted.\n");
+					mounted = 1;
 				} else {
 					printf("mount failed!\n");
 				}
 			} else {
-				printf("use: mount\n");
+				printf("use: mount [cacheblocks]\n");
+			}
+		} else if(!strcmp(cmd,"unmount")) {
+			if(args==1) {
+				if(fs_unmount()) {
+					printf("disk unmounted.\n");
+					mounted = 0;
+				} else {
+					printf("unmount failed!\n");
+				}
+			} else {
+				printf("use: unmount\n");
+			}
+		} else if(!strcmp(cmd,"check")) {
+			if(args==1) {
+				result = fs_check();
+				if(result>=0) {
+					printf("%d bitmap entries repaired\n",result);
+				} else {
+					printf("check failed!\n");
+				}
+			} else {
+				printf("use: check\n");
+			}
+		} else if(!strcmp(cmd,"sync")) {
+			if(args==1) {
+				if(fs_sync()) {
+					printf("delayed writes flushed.\n");
+				} else {
+					printf("sync failed!\n");
+				}
+			} else {
+				printf("use: sync\n");
 			}
 		} else if(!strcmp(cmd,"debug")) {
 			if(args==1) {
@@ -71,9 +115,9 @@ int main( int argc, char *argv[] )
 		} else if(!strcmp(cmd,"getsize")) {
 			if(args==2) {
 				inumber = atoi(arg1);
-				result = fs_getsize(inumber);
-				if(result>=0) {
-					printf("inode %d has size %d\n",inumber,result);
+				size = fs_getsize(inumber);
+				if(size>=0) {
+					printf("inode %d has size %lld\n",inumber,(long long)size);
 				} else {
 					printf("getsize failed!\n");
 				}
@@ -140,20 +184,73 @@ int main( int argc, char *argv[] )
 			if(args==1) {
 				fs_defrag();
 				printf("rearrangedd content\n");
+			} else if(args==2 && !strcmp(arg1,"dryrun")) {
+				struct fs_defrag_stats plan;
+				if(fs_defrag_plan(&plan)) {
+					printf("%d blocks to move\n",plan.moved);
+					printf("%lld blocks read in %lld requests\n",(long long)plan.reads,(long long)plan.read_requests);
+					printf("%lld blocks written in %lld requests\n",(long long)plan.writes,(long long)plan.write_requests);
+				} else {
+					printf("defrag plan failed!\n");
+				}
+			} else if(args==3 && !strcmp(arg1,"step")) {
+				struct fs_defrag_progress progress;
+				result = fs_defrag_step(atoi(arg2));
+				if(result>=0) {
+					fs_defrag_progress(&progress);
+					printf("%d blocks read and written\n",result);
+					printf("inode %d of %d, pass %d, %lld files and %lld blocks moved",progress.cursor,progress.ninodes,progress.passes,(long long)progress.files,(long long)progress.blocks);
+					if(progress.moving) printf(", moving inode %d",progress.moving);
+					printf("\n");
+				} else {
+					printf("defrag step failed!\n");
+				}
+			} else {
+				printf("use: defrag [dryrun|step <budget>]\n");
+			}
+
+		} else if(!strcmp(cmd,"readahead")) {
+			if(args==1) {
+				do_readahead();
+			} else {
+				printf("use: readahead\n");
+			}
+
+		} else if(!strcmp(cmd,"fragstat")) {
+			if(args==1 || (args==2 && !strcmp(arg1,"machine"))) {
+				if(!do_fragstat(args==2)) {
+					printf("fragstat failed!\n");
+				}
+			} else {
+				printf("use: fragstat [machine]\n");
+			}
+
+		} else if(!strcmp(cmd,"bench")) {
+			if(args==3) {
+				if(!bench_run(arg1,atoi(arg2))) {
+					printf("bench failed!\n");
+				}
 			} else {
-				printf("use: defrag\n");
+				printf("use: bench <name> <n>\n");
 			}
 
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
-			printf("    format\n");
-			printf("    mount\n");
+			printf("    format  [extent|indirect|classic] [discard]\n");
+			printf("    mount   [cacheblocks]\n");
+			printf("    unmount\n");
+			printf("    check\n");
+			printf("    sync\n");
 			printf("    debug\n");
 			printf("    create\n");
 			printf("    delete  <inode>\n");
 			printf("    cat     <inode>\n");
 			printf("    copyin  <file> <inode>\n");
 			printf("    copyout <inode> <file>\n");
+			printf("    defrag  [dryrun|step <budget>]\n");
+			printf("    readahead\n");
+			printf("    fragstat [machine]\n");
+			printf("    bench   <name> <n>\n");
 			printf("    help\n");
 			printf("    quit\n");
 			printf("    exit\n");
@@ -168,16 +265,36 @@ int main( int argc, char *argv[] )
 		}
 	}
 
+	if(mounted) fs_unmount();
+
 	printf("closing emulated disk.\n");
 	disk_close();
 
 	return 0;
 }
 
+static int disk_mode( const char *name )
+{
+	if(!strcmp(name,"pread")) return DISK_PREAD;
+	if(!strcmp(name,"mmap")) return DISK_MMAP;
+	if(!strcmp(name,"uring")) return DISK_URING;
+	if(!strcmp(name,"direct")) return DISK_DIRECT;
+	return -1;
+}
+
+static int format_version( const char *name )
+{
+	if(!strcmp(name,"extent")) return FS_FORMAT_EXTENT;
+	if(!strcmp(name,"indirect")) return FS_FORMAT_INDIRECT;
+	if(!strcmp(name,"classic")) return FS_FORMAT_CLASSIC;
+	return -1;
+}
+
 static int do_copyin( const char *filename, int inumber )
 {
 	FILE *file;
-	int offset=0, result, actual;
+	int64_t offset=0;
+	int result, actual, fd;
 	char buffer[16384];
 
 	file = fopen(filename,"r");
@@ -186,24 +303,31 @@ static int do_copyin( const char *filename, int inumber )
 		return 0;
 	}
 
+	fd = fs_open(inumber);
+	if(fd<0) {
+		fclose(file);
+		return 0;
+	}
+
 	while(1) {
 		result = fread(buffer,1,sizeof(buffer),file);
 		if(result<=0) break;
 		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
+			actual = fs_pwrite(fd,buffer,result,offset);
 			if(actual<0) {
-				printf("ERROR: fs_write return invalid result %d\n",actual);
+				printf("ERROR: fs_pwrite return invalid result %d\n",actual);
 				break;
 			}
 			offset += actual;
 			if(actual!=result) {
-				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
+				printf("WARNING: fs_pwrite only wrote %d bytes, not %d bytes\n",actual,result);
 				break;
 			}
 		}
 	}
 
-	printf("%d bytes copied\n",offset);
+	fs_close(fd);
+	printf("%lld bytes copied\n",(long long)offset);
 
 	fclose(file);
 	return 1;
@@ -212,25 +336,100 @@ static int do_copyin( const char *filename, int inumber )
 static int do_copyout( int inumber, const char *filename )
 {
 	FILE *file;
-	int offset=0, result;
+	int64_t offset=0;
+	int result, fd;
 	char buffer[16384];
 
+	fd = fs_open(inumber);
+	if(fd<0) return 0;
+
 	file = fopen(filename,"w");
 	if(!file) {
 		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		fs_close(fd);
 		return 0;
 	}
 
 	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
+		result = fs_pread(fd,buffer,sizeof(buffer),offset);
 		if(result<=0) break;
 		fwrite(buffer,1,result,file);
 		offset += result;
 	}
 
-	printf("%d bytes copied\n",offset);
+	fs_close(fd);
+	printf("%lld bytes copied\n",(long long)offset);
 
 	fclose(file);
 	return 1;
 }
 
+static void do_readahead()
+{
+	struct fs_readahead_stats s;
+
+	fs_readahead_stats(&s);
+	if(!s.window_limit) {
+		printf("readahead is off (no block cache)\n");
+	}
+	printf("%lld readahead requests, %lld blocks read ahead\n",(long long)s.fills,(long long)s.blocks);
+	printf("%lld blocks used by reads (%.1f%% hit rate)\n",(long long)s.hits,s.blocks ? 100.0*s.hits/s.blocks : 0.0);
+	printf("%d sequential streams, window average %d max %d limit %d blocks\n",
+		s.streams,s.streams ? s.window_total/s.streams : 0,s.window_max,s.window_limit);
+}
+
+/* layout of the disk. with machine set, one key=value pair per line for scripts */
+
+static int do_fragstat( int machine )
+{
+	struct fs_fragstat s;
+	double avg_run, avg_extents;
+	int i, k;
+
+	if(!fs_fragstat(&s)) return 0;
+
+	avg_run = s.extents ? (double)s.blocks/s.extents : 0.0;
+	avg_extents = s.files ? (double)s.extents/s.files : 0.0;
+
+	if(machine) {
+		printf("files=%d\n",s.files);
+		printf("fragmented=%d\n",s.fragmented);
+		printf("blocks=%lld\n",(long long)s.blocks);
+		printf("extents=%lld\n",(long long)s.extents);
+		printf("max_extents=%d\n",s.max_extents);
+		printf("avg_run=%.2f\n",avg_run);
+		printf("seeks=%lld\n",(long long)s.seeks);
+		printf("free_blocks=%lld\n",(long long)s.free_blocks);
+		printf("free_runs=%d\n",s.nfree_runs);
+		printf("free_run_max=%d\n",s.free_run_max);
+		for(k=0;k<FS_FRAG_BUCKETS;k++) {
+			printf("free_runs_%d=%d\n",1<<k,s.free_runs[k]);
+		}
+		printf("delayed_files=%d\n",s.delayed_files);
+		printf("delayed_blocks=%lld\n",(long long)s.delayed_blocks);
+		for(i=1;i<s.ninodes;i++) {
+			if(s.file[i].blocks) printf("inode_%d=%d,%d\n",i,s.file[i].blocks,s.file[i].extents);
+		}
+	} else {
+		printf("%d files, %d in more than one extent\n",s.files,s.fragmented);
+		printf("%lld blocks in %lld extents, %.1f extents per file (max %d), average run %.1f blocks\n",
+			(long long)s.blocks,(long long)s.extents,avg_extents,s.max_extents,avg_run);
+		printf("about %lld seeks to read every file\n",(long long)s.seeks);
+		printf("%lld free blocks in %d runs, longest %d\n",(long long)s.free_blocks,s.nfree_runs,s.free_run_max);
+		for(k=0;k<FS_FRAG_BUCKETS;k++) {
+			if(!s.free_runs[k]) continue;
+			if(k==FS_FRAG_BUCKETS-1) printf("    %6d+       blocks: %d runs\n",1<<k,s.free_runs[k]);
+			else printf("    %6d-%-6d blocks: %d runs\n",1<<k,(2<<k)-1,s.free_runs[k]);
+		}
+		if(s.delayed_files) {
+			printf("%lld blocks of %d files wait in delayed write buffers, not counted above\n",
+				(long long)s.delayed_blocks,s.delayed_files);
+		}
+		for(i=1;i<s.ninodes;i++) {
+			if(s.file[i].extents>1) printf("inode %d: %d blocks in %d extents\n",i,s.file[i].blocks,s.file[i].extents);
+		}
+	}
+
+	free(s.file);
+	return 1;
+}